@@ -1,11 +1,27 @@
+#define _GNU_SOURCE
+
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <poll.h>
 #include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
 
 #include <mpd/client.h>
 #include <raylib.h>
@@ -148,21 +164,79 @@ void buffer_push_number(Buffer *buffer, size_t number) {
     buffer_push_string(buffer, temp);
 }
 
+// Time
+double time_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Hash
+#define HASH_SEED 0xcbf29ce484222325
+
+// FNV-1a. Pieces can be hashed as one by passing the hash of the previous one along
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t size) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3;
+    }
+    return hash;
+}
+
+// Workers
+#define WORKERS_MAX 64
+
+// Run the worker on up to one thread per core, but no more than there are jobs, and wait for all
+// of them. The calling thread is one of the workers, so the work gets done even if no thread
+// could be started
+void workers_run(void *(*worker)(void *), void *arg, size_t jobs) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t count = min(min(max(cores, 1), WORKERS_MAX), jobs);
+
+    pthread_t workers[WORKERS_MAX];
+    size_t started = 0;
+    for (; started + 1 < count; started++) {
+        if (pthread_create(&workers[started], NULL, worker, arg)) {
+            break;
+        }
+    }
+
+    worker(arg);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+}
+
 // Album
 typedef struct {
     char *value;
     bool ready;
 } Link;
 
+// Shared between all the albums which list the same link
 typedef struct {
-    Link *data;
+    Link **data;
     size_t count;
     size_t capacity;
 } Links;
 
+typedef enum {
+    SONG_UNKNOWN,
+    SONG_OK,
+    SONG_ABSENT,
+    SONG_CORRUPT,
+} SongStatus;
+
 typedef struct {
     char *name;
     char *path;
+    bool missing;
+
+    // Filled in by the scanner
+    SongStatus status;
+    float duration;
+    off_t size;
+    time_t mtime;
 } Song;
 
 typedef struct {
@@ -171,28 +245,109 @@ typedef struct {
     size_t capacity;
 } Songs;
 
+typedef enum {
+    SCAN_IDLE,
+    SCAN_QUEUED,
+    SCAN_RUNNING,
+    SCAN_AGAIN,
+} ScanState;
+
 typedef struct {
     char *name;
     bool ready;
+    size_t cover;
+
+    // Guarded by the lock of the scanner, so that only one worker scans the album at a time
+    ScanState scan;
+
+    // The songs are not listed in the config, but taken from the downloaded files instead
+    bool generated;
+
+    // The links and songs are only parsed out of the body once the album is needed
+    bool lazy;
+    Str body;
 
     Links links;
     Songs songs;
 } Album;
 
+void songs_free(Songs *songs) {
+    for (size_t i = 0; i < songs->count; i++) {
+        free(songs->data[i].name);
+        free(songs->data[i].path);
+    }
+    list_free(songs);
+}
+
 void album_free(Album *album) {
     list_free(&album->links);
-    list_free(&album->songs);
+    if (album->generated) {
+        songs_free(&album->songs);
+    } else {
+        list_free(&album->songs);
+    }
 }
 
-void album_mark_ready(Album *album) {
-    if (!album->ready) {
-        for (size_t i = 0; i < album->links.count; i++) {
-            if (!album->links.data[i].ready) {
-                return;
-            }
+// The songs are replaced while the other threads read them without locking, so they are read
+// through a snapshot. The list is published by clearing the count, then storing the data and the
+// new count, and the replaced lists are kept until exit. A snapshot which saw the same data before
+// and after reading the count is therefore consistent
+Songs album_songs(Album *album) {
+    Songs songs = {0};
+    do {
+        songs.data = __atomic_load_n(&album->songs.data, __ATOMIC_ACQUIRE);
+        songs.count = __atomic_load_n(&album->songs.count, __ATOMIC_ACQUIRE);
+    } while (songs.data != __atomic_load_n(&album->songs.data, __ATOMIC_ACQUIRE));
+    return songs;
+}
+
+void album_publish_songs(Album *album, Songs songs) {
+    __atomic_store_n(&album->songs.count, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&album->songs.data, songs.data, __ATOMIC_RELEASE);
+    album->songs.capacity = songs.capacity;
+    __atomic_store_n(&album->songs.count, songs.count, __ATOMIC_RELEASE);
+}
+
+size_t songs_next(Songs *songs, size_t song) {
+    while (song < songs->count && songs->data[song].missing) {
+        song++;
+    }
+    return song;
+}
+
+// Returns the count if the song is not in the list
+size_t songs_index(Songs *songs, Song *song) {
+    for (size_t i = 0; i < songs->count; i++) {
+        if (&songs->data[i] == song) {
+            return i;
         }
+    }
+    return songs->count;
+}
+
+bool album_links_ready(Album *album) {
+    for (size_t i = 0; i < album->links.count; i++) {
+        if (!album->links.data[i]->ready) {
+            return false;
+        }
+    }
+
+    return true;
+}
 
-        album->ready = true;
+// Total length of the songs scanned so far
+float album_duration(Album *album) {
+    Songs songs = album_songs(album);
+    float duration = 0;
+    for (size_t i = 0; i < songs.count; i++) {
+        duration += songs.data[i].duration;
+    }
+    return duration;
+}
+
+void album_mark_ready(Album *album) {
+    if (!album->ready) {
+        album->ready = album_links_ready(album);
     }
 }
 
@@ -212,27 +367,73 @@ void artist_free(Artist *artist) {
     list_free(artist);
 }
 
-bool artist_mark_link(Artist *artist, Str str) {
-    for (size_t i = 0; i < artist->count; i++) {
-        Album *album = &artist->data[i];
-        for (size_t j = 0; j < album->links.count; j++) {
-            Link *link = &album->links.data[j];
-            if (str_match(str, link->value)) {
-                link->ready = true;
-                return true;
-            }
+// Library
+#define CONFIG_INCLUDE "@include "
+
+typedef struct {
+    Artist *artist;
+    Album *album;
+} AlbumRef;
+
+typedef struct {
+    AlbumRef *data;
+    size_t count;
+    size_t capacity;
+} AlbumRefs;
+
+void album_refs_push(AlbumRefs *refs, AlbumRef ref) {
+    for (size_t i = 0; i < refs->count; i++) {
+        if (refs->data[i].album == ref.album) {
+            return;
         }
     }
+    list_append(refs, ref);
+}
 
-    return false;
+// Build 'Artist/Album' with the prefix and suffix around it
+void album_ref_path(Buffer *buffer, const char *prefix, AlbumRef ref, const char *suffix) {
+    buffer->count = 0;
+    buffer_push_string(buffer, prefix);
+    buffer_push_string(buffer, ref.artist->name);
+    list_append(buffer, '/');
+    buffer_push_string(buffer, ref.album->name);
+    buffer_push_string(buffer, suffix);
+    list_append(buffer, '\0');
 }
 
-// Library
 typedef struct {
+    const char *path;
     size_t line;
     const char *message;
 } Error;
 
+typedef struct {
+    char *path;
+    size_t line;
+    size_t position;
+} Include;
+
+typedef struct {
+    Include *data;
+    size_t count;
+    size_t capacity;
+} Includes;
+
+typedef struct {
+    Link *link;
+    AlbumRefs owners;
+} LibraryLink;
+
+// Every distinct link in the order it first appears in, indexed by value
+typedef struct {
+    LibraryLink *data;
+    size_t count;
+    size_t capacity;
+
+    size_t *table;
+    size_t table_size;
+} LibraryLinks;
+
 typedef struct {
     Artist *data;
     size_t count;
@@ -240,19 +441,134 @@ typedef struct {
 
     char *config;
     size_t pending;
+    LibraryLinks links;
+
+    bool lazy;
+    char *ready;
+    pthread_mutex_t lock;
+
+    // The artists belong to the config files they were parsed from
+    bool shared;
+    Includes includes;
 } Library;
 
 void library_free(Library *library) {
-    for (size_t i = 0; i < library->count; i++) {
+    for (size_t i = 0; !library->shared && i < library->count; i++) {
         artist_free(&library->data[i]);
     }
+    list_free(&library->includes);
+
+    for (size_t i = 0; i < library->links.count; i++) {
+        free(library->links.data[i].link);
+        list_free(&library->links.data[i].owners);
+    }
+    free(library->links.table);
+    list_free(&library->links);
+
     UnloadFileText(library->config);
+    UnloadFileText(library->ready);
+    pthread_mutex_destroy(&library->lock);
     list_free(library);
 }
 
+size_t library_hash(Str value, size_t size) {
+    return hash_bytes(HASH_SEED, value.data, value.size) & (size - 1);
+}
+
+LibraryLink *library_find_link(Library *library, Str value) {
+    LibraryLinks *links = &library->links;
+    if (links->table_size == 0) {
+        return NULL;
+    }
+
+    size_t i = library_hash(value, links->table_size);
+    while (links->table[i]) {
+        LibraryLink *entry = &links->data[links->table[i] - 1];
+        if (str_match(value, entry->link->value)) {
+            return entry;
+        }
+        i = (i + 1) & (links->table_size - 1);
+    }
+
+    return NULL;
+}
+
+Link *library_add_link(Library *library, char *value) {
+    LibraryLink *entry = library_find_link(library, str_from_cstr(value));
+    if (entry) {
+        return entry->link;
+    }
+
+    LibraryLinks *links = &library->links;
+    Link *link = malloc(sizeof(Link));
+    assert(link);
+    *link = (Link){.value = value};
+
+    LibraryLink added = {.link = link};
+    list_append(links, added);
+
+    if (links->count * 2 > links->table_size) {
+        free(links->table);
+        links->table_size = links->table_size ? links->table_size * 2 : LIST_INIT_CAP;
+        links->table = calloc(links->table_size, sizeof(*links->table));
+        assert(links->table);
+
+        for (size_t i = 0; i + 1 < links->count; i++) {
+            size_t j = library_hash(str_from_cstr(links->data[i].link->value), links->table_size);
+            while (links->table[j]) {
+                j = (j + 1) & (links->table_size - 1);
+            }
+            links->table[j] = i + 1;
+        }
+    }
+
+    size_t i = library_hash(str_from_cstr(value), links->table_size);
+    while (links->table[i]) {
+        i = (i + 1) & (links->table_size - 1);
+    }
+    links->table[i] = links->count;
+    return link;
+}
+
+// Add the link or song in the line to the album
+void library_parse_entry(Library *library, Album *album, Str line) {
+    Str name = str_trim(str_split(&line, '@'), ' ');
+    char *value = str_to_cstr(str_trim(line, ' '));
+
+    if (name.size == 0) {
+        Link *link = library_add_link(library, value);
+        list_append(&album->links, link);
+    } else {
+        Song song = {
+            .name = str_to_cstr(name),
+            .path = value,
+        };
+
+        list_append(&album->songs, song);
+    }
+}
+
+// Must be called once the album has its links
+void library_own_links(Library *library, Artist *artist, Album *album) {
+    album->generated = album->songs.count == 0 && album->links.count > 0;
+
+    AlbumRef owner = {
+        .artist = artist,
+        .album = album,
+    };
+
+    for (size_t i = 0; i < album->links.count; i++) {
+        Str value = str_from_cstr(album->links.data[i]->value);
+        album_refs_push(&library_find_link(library, value)->owners, owner);
+    }
+}
+
+// In lazy mode only the artists and albums are parsed, and the lines of each album are kept for
+// library_expand
 Error library_parse(Library *library) {
     Album *album = NULL;
     Artist *artist = NULL;
+    pthread_mutex_init(&library->lock, NULL);
 
     Str contents = str_from_cstr(library->config);
     for (size_t row = 1; contents.size > 0; row++) {
@@ -270,6 +586,23 @@ Error library_parse(Library *library) {
 
         switch (indent) {
         case 0:
+            if (line.size > strlen(CONFIG_INCLUDE) &&
+                !memcmp(line.data, CONFIG_INCLUDE, strlen(CONFIG_INCLUDE))) {
+                line.data += strlen(CONFIG_INCLUDE);
+                line.size -= strlen(CONFIG_INCLUDE);
+
+                Include include = {
+                    .path = str_to_cstr(str_trim(line, ' ')),
+                    .line = row,
+                    .position = library->count,
+                };
+                list_append(&library->includes, include);
+
+                artist = NULL;
+                album = NULL;
+                break;
+            }
+
             list_append(library, (Artist){0});
             artist = &library->data[library->count - 1];
             artist->name = str_to_cstr(line);
@@ -285,30 +618,19 @@ Error library_parse(Library *library) {
             list_append(artist, (Album){0});
             album = &artist->data[artist->count - 1];
             album->name = str_to_cstr(line);
+            album->lazy = library->lazy;
+            album->body = (Str){.data = contents.data};
             break;
 
         case 2:
             if (album == NULL) {
                 return (Error){.line = row, .message = "encountered song/link without an album"};
-            } else {
-                Str name = str_trim(str_split(&line, '@'), ' ');
-                char *value = str_to_cstr(str_trim(line, ' '));
-
-                if (name.size == 0) {
-                    Link link = {
-                        .ready = false,
-                        .value = value,
-                    };
-
-                    list_append(&album->links, link);
-                } else {
-                    Song song = {
-                        .name = str_to_cstr(name),
-                        .path = value,
-                    };
+            }
 
-                    list_append(&album->songs, song);
-                }
+            if (album->lazy) {
+                album->body.size = contents.data - album->body.data;
+            } else {
+                library_parse_entry(library, album, line);
             }
             break;
 
@@ -317,23 +639,130 @@ Error library_parse(Library *library) {
         }
     }
 
+    // The albums stay where they are from now on
+    for (size_t i = 0; i < library->count; i++) {
+        Artist *artist = &library->data[i];
+        for (size_t j = 0; j < artist->count; j++) {
+            library_own_links(library, artist, &artist->data[j]);
+        }
+    }
+
     return (Error){0};
 }
 
+// Parse the links and songs of a lazy album. Returns false if it was expanded already. The lists
+// are filled in before being published, since the other threads read them without locking
+bool library_expand(Library *library, Artist *artist, Album *album) {
+    if (!album->lazy) {
+        return false;
+    }
+
+    pthread_mutex_lock(&library->lock);
+    bool expanded = album->lazy;
+    if (expanded) {
+        Album parsed = {0};
+        Str body = album->body;
+        while (body.size > 0) {
+            Str line = str_trim(str_split(&body, '\n'), ' ');
+            while (line.size > 0 && *line.data == '\t') {
+                line.data++;
+                line.size--;
+            }
+
+            if (line.size > 0 && *line.data != '#') {
+                library_parse_entry(library, &parsed, line);
+            }
+        }
+
+        album->links.data = parsed.links.data;
+        album->links.capacity = parsed.links.capacity;
+        __atomic_store_n(&album->links.count, parsed.links.count, __ATOMIC_RELEASE);
+        album_publish_songs(album, parsed.songs);
+
+        library_own_links(library, artist, album);
+        album->lazy = false;
+    }
+    pthread_mutex_unlock(&library->lock);
+
+    return expanded;
+}
+
+// Find the next link in the body of a lazy album without parsing the rest of it
+bool library_body_link(Str *body, Str *value) {
+    while (body->size > 0) {
+        Str line = str_trim(str_split(body, '\n'), ' ');
+        while (line.size > 0 && *line.data == '\t') {
+            line.data++;
+            line.size--;
+        }
+
+        if (line.size > 0 && *line.data == '@') {
+            line.data++;
+            line.size--;
+            *value = str_trim(line, ' ');
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Lazy albums with links which have not been downloaded yet are expanded right away, so that the
+// downloader sees all of them. Everything else stays lazy
+void library_expand_pending(Library *library) {
+    for (size_t i = 0; i < library->count; i++) {
+        Artist *artist = &library->data[i];
+        for (size_t j = 0; j < artist->count; j++) {
+            Album *album = &artist->data[j];
+
+            bool pending = false;
+            Str body = album->body;
+            Str value;
+            while (album->lazy && !pending && library_body_link(&body, &value)) {
+                LibraryLink *entry = library_find_link(library, value);
+                pending = !entry || !entry->link->ready;
+            }
+
+            if (pending) {
+                library_expand(library, artist, album);
+            }
+        }
+    }
+}
+
+void library_count_pending(Library *library) {
+    library->pending = 0;
+    for (size_t i = 0; i < library->links.count; i++) {
+        if (!library->links.data[i].link->ready) {
+            library->pending++;
+        }
+    }
+}
+
 void library_mark_links(Library *library) {
     char *links = LoadFileText(".links");
     if (links) {
         Str contents = str_from_cstr(links);
         while (contents.size > 0) {
-            Str link = str_split(&contents, '\n');
-            for (size_t i = 0; i < library->count; i++) {
-                if (artist_mark_link(&library->data[i], link)) {
-                    break;
-                }
+            Str value = str_split(&contents, '\n');
+            LibraryLink *entry = library_find_link(library, value);
+            if (entry) {
+                entry->link->ready = true;
+            } else if (library->lazy && value.size) {
+                // The albums listing it might not have been parsed yet
+                library_add_link(library, str_to_cstr(value))->ready = true;
             }
         }
-        UnloadFileText(links);
 
+        if (library->lazy) {
+            library->ready = links;
+        } else {
+            UnloadFileText(links);
+        }
+    }
+
+    library_expand_pending(library);
+    if (links) {
         for (size_t i = 0; i < library->count; i++) {
             Artist *artist = &library->data[i];
             for (size_t j = 0; j < artist->count; j++) {
@@ -342,336 +771,4006 @@ void library_mark_links(Library *library) {
         }
     }
 
-    for (size_t i = 0; i < library->count; i++) {
-        Artist *artist = &library->data[i];
-        for (size_t j = 0; j < artist->count; j++) {
-            Album *album = &artist->data[j];
-            for (size_t k = 0; k < album->links.count; k++) {
-                if (!album->links.data[k].ready) {
-                    library->pending++;
-                }
-            }
-        }
-    }
+    library_count_pending(library);
 }
 
+// Links which no album lists anymore are dropped. The albums which are still lazy do not own their
+// links yet, so their bodies are looked through instead
 bool library_save_links(Library *library, const char *path) {
     FILE *f = fopen(path, "w");
     if (!f) {
         return false;
     }
 
-    for (size_t i = 0; i < library->count; i++) {
+    bool *listed = calloc(library->links.count + 1, sizeof(bool));
+    assert(listed);
+    for (size_t i = 0; i < library->links.count; i++) {
+        listed[i] = library->links.data[i].owners.count > 0;
+    }
+
+    for (size_t i = 0; library->lazy && i < library->count; i++) {
         Artist *artist = &library->data[i];
         for (size_t j = 0; j < artist->count; j++) {
             Album *album = &artist->data[j];
-            for (size_t k = 0; k < album->links.count; k++) {
-                Link *link = &album->links.data[k];
-                if (link->ready) {
-                    fprintf(f, "%s\n", link->value);
+
+            Str body = album->body;
+            Str value;
+            while (album->lazy && library_body_link(&body, &value)) {
+                LibraryLink *entry = library_find_link(library, value);
+                if (entry) {
+                    listed[entry - library->links.data] = true;
                 }
             }
         }
     }
 
+    for (size_t i = 0; i < library->links.count; i++) {
+        Link *link = library->links.data[i].link;
+        if (link->ready && listed[i]) {
+            fprintf(f, "%s\n", link->value);
+        }
+    }
+
+    free(listed);
     fclose(f);
     return true;
 }
 
-// Popups
-typedef enum {
-    POPUP_STARTED,
-    POPUP_DOWNLOAD_OK,
-    POPUP_DOWNLOAD_ERROR,
-    POPUP_CONFIG_ERROR,
-    POPUP_GENERAL_ERROR,
-} PopupType;
-
-Color popup_type_color(PopupType type) {
-    if (type == POPUP_STARTED || type == POPUP_DOWNLOAD_OK) {
-        return SUCCESS_COLOR;
-    }
+// Queue
+// Songs left after the current one before more are appended, and the most appended at once
+#define QUEUE_PREFETCH 2
+#define QUEUE_BATCH 16
 
-    return ERROR_COLOR;
-}
+typedef struct {
+    Artist *artist;
+    Album *album;
+    size_t song;
+    unsigned id;
+} QueueItem;
 
 typedef struct {
-    PopupType type;
-    size_t number;
-    const char *string;
+    QueueItem *data;
+    size_t count;
+    size_t capacity;
 
-    float lifetime;
-} Popup;
+    unsigned version;
+    pthread_mutex_t lock;
+
+    // Albums to play once the queue runs out, and whether to go on with the following albums of
+    // the artist after that
+    AlbumRefs upcoming;
+    bool continuous;
+} Queue;
+
+// Find the available songs of the album which are already queued in order, starting from the first
+// one. The song to continue from is stored in next
+size_t queue_find_album(Queue *queue, Album *album, size_t *start, size_t *next) {
+    size_t i = 0;
+    while (i < queue->count && queue->data[i].album != album) {
+        i++;
+    }
 
-void popup_render(Popup *popup, Buffer *buffer) {
-    buffer->count = 0;
-    switch (popup->type) {
-    case POPUP_STARTED:
-        buffer_push_number(buffer, popup->number);
-        list_append(buffer, ' ');
-        buffer_push_string(buffer, popup->string);
-        if (popup->number != 1) {
-            list_append(buffer, 's');
+    Songs songs = album_songs(album);
+    size_t count = 0;
+    size_t song = songs_next(&songs, 0);
+    while (i + count < queue->count && song < songs.count) {
+        QueueItem *item = &queue->data[i + count];
+        if (item->album != album || item->song != song) {
+            break;
         }
-        buffer_push_string(buffer, " started");
-        break;
 
-    case POPUP_DOWNLOAD_OK:
-        buffer_push_string(buffer, "Downloaded ");
-        buffer_push_string(buffer, popup->string);
-        break;
+        count++;
+        song = songs_next(&songs, song + 1);
+    }
 
-    case POPUP_DOWNLOAD_ERROR:
-        buffer_push_string(buffer, "Could not download ");
-        buffer_push_string(buffer, popup->string);
-        break;
+    *start = i;
+    *next = song;
+    return count;
+}
 
-    case POPUP_CONFIG_ERROR:
-        buffer_push_string(buffer, popup->string);
-        buffer_push_string(buffer, " in line ");
-        buffer_push_number(buffer, popup->number);
-        break;
+// Send the songs of the album from the song on, at most limit of them, and track them
+void queue_send_songs(Queue *queue, struct mpd_connection *mpd, Buffer *buffer, Artist *artist,
+                      Album *album, size_t song, size_t limit) {
+    buffer->count = 0;
+    buffer_push_string(buffer, artist->name);
+    list_append(buffer, '/');
+    buffer_push_string(buffer, album->name);
+    list_append(buffer, '/');
+
+    Songs songs = album_songs(album);
+    size_t prefix = buffer->count;
+    for (size_t i = song; i < songs.count && limit > 0; i = songs_next(&songs, i + 1)) {
+        buffer->count = prefix;
+        buffer_push_string(buffer, songs.data[i].path);
+        list_append(buffer, '\0');
+
+        mpd_send_add_id(mpd, buffer->data);
+
+        QueueItem item = {
+            .artist = artist,
+            .album = album,
+            .song = i,
+        };
 
-    case POPUP_GENERAL_ERROR:
-        buffer_push_string(buffer, popup->string);
-        break;
+        list_append(queue, item);
+        limit--;
     }
-    list_append(buffer, '\0');
 }
 
-#define POPUP_SLIDEIN 0.1
-#define POPUP_LIFETIME 4.0
-
-#define POPUPS_CAPACITY 20
+// Receive the ids of the songs tracked from added on
+bool queue_recv_songs(Queue *queue, struct mpd_connection *mpd, size_t added) {
+    for (size_t i = added; i < queue->count; i++) {
+        int id = mpd_recv_song_id(mpd);
+        if (id < 0 || !mpd_response_next(mpd)) {
+            return false;
+        }
 
-#define popups_get(p, index)                                                                       \
-    (assert(index < (p)->count), &(p)->items[((p)->begin + index) % POPUPS_CAPACITY])
+        queue->data[i].id = id;
+    }
 
-#define popups_first(p) popups_get((p), 0)
-#define popups_last(p) popups_get((p), (p)->count - 1)
+    return true;
+}
+
+// Keep the version of the queue the songs were added in, so that it is not mistaken for somebody
+// else changing it
+void queue_recv_version(Queue *queue, struct mpd_connection *mpd) {
+    struct mpd_status *status = mpd_recv_status(mpd);
+    if (status) {
+        queue->version = mpd_status_get_queue_version(status);
+        mpd_status_free(status);
+    }
+}
+
+// Play the song with the album queued around it, reusing whatever is already queued
+bool queue_play(Queue *queue, struct mpd_connection *mpd, Buffer *buffer, Artist *artist,
+                Album *album, size_t song) {
+    Songs songs = album_songs(album);
+    if (song >= songs.count || songs.data[song].missing) {
+        return false;
+    }
+
+    pthread_mutex_lock(&queue->lock);
+
+    // Only append the songs which are missing from the queue. If the album is not the last thing
+    // in the queue then there is no telling what comes after it, so start over
+    size_t start, next;
+    size_t queued = queue_find_album(queue, album, &start, &next);
+    if (next < songs.count && start + queued != queue->count) {
+        queued = 0;
+    }
+
+    bool clear = queued == 0;
+    if (clear) {
+        start = 0;
+        next = songs_next(&songs, 0);
+        queue->count = 0;
+    }
+
+    mpd_command_list_begin(mpd, true);
+    if (clear) {
+        mpd_send_clear(mpd);
+    }
+
+    size_t added = queue->count;
+    queue_send_songs(queue, mpd, buffer, artist, album, next, SIZE_MAX);
+
+    size_t position = start;
+    for (size_t i = start; i < queue->count; i++) {
+        if (queue->data[i].song == song) {
+            position = i;
+            break;
+        }
+    }
+
+    if (position < added) {
+        mpd_send_play_id(mpd, queue->data[position].id);
+    } else {
+        mpd_send_play_pos(mpd, position);
+    }
+
+    mpd_send_status(mpd);
+    mpd_command_list_end(mpd);
+
+    bool ok = (!clear || mpd_response_next(mpd)) && queue_recv_songs(queue, mpd, added);
+    if (ok && mpd_response_next(mpd)) {
+        queue_recv_version(queue, mpd);
+    }
+
+    mpd_response_finish(mpd);
+
+    ok = mpd_connection_get_error(mpd) == MPD_ERROR_SUCCESS;
+    if (!ok) {
+        queue->count = 0;
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+    return ok;
+}
+
+// Append a batch of songs of the item's album to the end of the queue, starting to play them if
+// MPD stopped there. The songs go to added rather than the queue, so that the lock does not have to
+// be held while MPD answers; the caller tracks them if the queue did not change in the meantime
+bool queue_append(struct mpd_connection *mpd, Buffer *buffer, QueueItem *item, size_t position,
+                  bool play, Queue *added) {
+    mpd_command_list_begin(mpd, true);
+    queue_send_songs(added, mpd, buffer, item->artist, item->album, item->song, QUEUE_BATCH);
+    if (play) {
+        mpd_send_play_pos(mpd, position);
+    }
+    mpd_send_status(mpd);
+    mpd_command_list_end(mpd);
+
+    bool ok = queue_recv_songs(added, mpd, 0);
+    if (ok && (!play || mpd_response_next(mpd))) {
+        queue_recv_version(added, mpd);
+    }
+
+    mpd_response_finish(mpd);
+    return mpd_connection_get_error(mpd) == MPD_ERROR_SUCCESS;
+}
+
+void queue_reset(Queue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    queue->count = 0;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Somebody else modified the queue, so the tracked songs can no longer be trusted. Versions older
+// than the tracked one come from a status which was in flight while the queue was being played
+void queue_check_version(Queue *queue, unsigned version) {
+    pthread_mutex_lock(&queue->lock);
+    if ((int)(version - queue->version) > 0) {
+        queue->count = 0;
+    }
+    pthread_mutex_unlock(&queue->lock);
+}
 
+// Returns false if the position is not tracked
+bool queue_get(Queue *queue, int position, QueueItem *item) {
+    pthread_mutex_lock(&queue->lock);
+    bool found = position >= 0 && (size_t)position < queue->count;
+    if (found) {
+        *item = queue->data[position];
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
+
+// Playback
 typedef struct {
-    Popup items[POPUPS_CAPACITY];
-    size_t begin;
+    enum mpd_state state;
+    int song;
+    float elapsed;
+    float total;
+    double time;
+} Playback;
+
+typedef struct {
+    pthread_mutex_t lock;
+    Playback sample;
+} PlaybackSample;
+
+// Interpolate the elapsed time from the last sample, so that it only has to be taken when MPD
+// reports a change
+float playback_elapsed(Playback *playback, double now) {
+    if (playback->state != MPD_STATE_PLAY) {
+        return playback->elapsed;
+    }
+    return min(playback->elapsed + (now - playback->time), playback->total);
+}
+
+Playback playback_get(PlaybackSample *sample) {
+    pthread_mutex_lock(&sample->lock);
+    Playback playback = sample->sample;
+    pthread_mutex_unlock(&sample->lock);
+    return playback;
+}
+
+void playback_set(PlaybackSample *sample, Playback playback) {
+    pthread_mutex_lock(&sample->lock);
+    sample->sample = playback;
+    pthread_mutex_unlock(&sample->lock);
+}
+
+bool playback_update(PlaybackSample *sample, Queue *queue, struct mpd_connection *mpd) {
+    struct mpd_status *status = mpd_run_status(mpd);
+    if (!status) {
+        return false;
+    }
+
+    Playback playback = {
+        .state = mpd_status_get_state(status),
+        .song = mpd_status_get_song_pos(status),
+        .elapsed = mpd_status_get_elapsed_ms(status) / 1000.0,
+        .total = mpd_status_get_total_time(status),
+        .time = time_now(),
+    };
+
+    queue_check_version(queue, mpd_status_get_queue_version(status));
+    mpd_status_free(status);
+
+    playback_set(sample, playback);
+    return true;
+}
+
+// Database
+#define DATABASE_BATCH 64
+#define DATABASE_DEBOUNCE 2.0
+
+typedef struct {
+    unsigned id;
+    AlbumRef ref;
+} DatabaseJob;
+
+typedef struct {
+    DatabaseJob *data;
     size_t count;
-    float slide;
-} Popups;
+    size_t capacity;
+} DatabaseJobs;
 
-void popups_push(Popups *popups, PopupType type, size_t number, const char *string) {
-    if (popups->count < POPUPS_CAPACITY) {
-        if (popups->begin == 0) {
-            popups->begin = POPUPS_CAPACITY - 1;
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int wake[2];
+
+    bool connected;
+    AlbumRefs dirty;
+    double pushed;
+    bool quit;
+
+    // Albums whose songs only need to be looked up, since their files did not change
+    AlbumRefs listing;
+} Database;
+
+void database_wake(Database *database) {
+    char byte = 0;
+    if (write(database->wake[1], &byte, 1) < 0) {
+        // The pipe is full, so the thread is going to wake up anyway
+    }
+}
+
+// Returns false if the database is not being tracked, in which case nothing is going to wait for
+// the album to show up in MPD
+bool database_push(Database *database, Artist *artist, Album *album) {
+    pthread_mutex_lock(&database->lock);
+    if (!database->connected) {
+        pthread_mutex_unlock(&database->lock);
+        return false;
+    }
+
+    AlbumRef ref = {
+        .artist = artist,
+        .album = album,
+    };
+
+    album_refs_push(&database->dirty, ref);
+    database->pushed = time_now();
+    pthread_mutex_unlock(&database->lock);
+
+    database_wake(database);
+    return true;
+}
+
+// Look up the songs of the album without updating its directory. Nothing needs to be done while
+// the database is not tracked, as every album is looked up once it is
+void database_push_list(Database *database, Artist *artist, Album *album) {
+    AlbumRef ref = {
+        .artist = artist,
+        .album = album,
+    };
+
+    pthread_mutex_lock(&database->lock);
+    bool connected = database->connected;
+    if (connected) {
+        album_refs_push(&database->listing, ref);
+    }
+    pthread_mutex_unlock(&database->lock);
+
+    if (connected) {
+        database_wake(database);
+    }
+}
+
+void database_album_path(Buffer *buffer, AlbumRef ref) {
+    album_ref_path(buffer, "", ref, "");
+}
+
+// Mark the songs of the albums which MPD does not know about. A directory missing from the database
+// aborts the rest of the command list, so the remaining albums are sent again in a new one
+bool database_list(struct mpd_connection *mpd, Buffer *buffer, AlbumRef *refs, size_t count) {
+    while (count > 0) {
+        mpd_command_list_begin(mpd, true);
+        for (size_t i = 0; i < count; i++) {
+            // Recursive, since songs can live in subdirectories of the album like 'disc1/01.mp3'
+            database_album_path(buffer, refs[i]);
+            mpd_send_list_all_meta(mpd, buffer->data);
+        }
+        mpd_command_list_end(mpd);
+
+        size_t i = 0;
+        for (; i < count; i++) {
+            Songs songs = album_songs(refs[i].album);
+            bool *found = calloc(songs.count + 1, sizeof(bool));
+            assert(found);
+
+            database_album_path(buffer, refs[i]);
+            size_t prefix = buffer->count;
+
+            struct mpd_entity *entity;
+            while ((entity = mpd_recv_entity(mpd))) {
+                if (mpd_entity_get_type(entity) == MPD_ENTITY_TYPE_SONG) {
+                    const char *uri = mpd_song_get_uri(mpd_entity_get_song(entity));
+                    if (!strncmp(uri, buffer->data, prefix - 1) && uri[prefix - 1] == '/') {
+                        for (size_t j = 0; j < songs.count; j++) {
+                            if (!strcmp(uri + prefix, songs.data[j].path)) {
+                                found[j] = true;
+                            }
+                        }
+                    }
+                }
+                mpd_entity_free(entity);
+            }
+
+            enum mpd_error error = mpd_connection_get_error(mpd);
+            if (error == MPD_ERROR_SUCCESS || error == MPD_ERROR_SERVER) {
+                for (size_t j = 0; j < songs.count; j++) {
+                    songs.data[j].missing = !found[j];
+                }
+            }
+            free(found);
+
+            if (error == MPD_ERROR_SERVER) {
+                if (!mpd_connection_clear_error(mpd)) {
+                    return false;
+                }
+                break;
+            }
+
+            if (error != MPD_ERROR_SUCCESS || !mpd_response_next(mpd)) {
+                return false;
+            }
+        }
+
+        if (i == count && !mpd_response_finish(mpd)) {
+            return false;
+        }
+
+        i = min(i + 1, count);
+        refs += i;
+        count -= i;
+    }
+
+    return true;
+}
+
+// Start an update job for each album. The albums which MPD refuses to update cannot be waited for,
+// so they are marked ready right away
+bool database_update(struct mpd_connection *mpd, Buffer *buffer, AlbumRefs *refs,
+                     DatabaseJobs *jobs) {
+    mpd_command_list_begin(mpd, true);
+    for (size_t i = 0; i < refs->count; i++) {
+        database_album_path(buffer, refs->data[i]);
+        mpd_send_update(mpd, buffer->data);
+    }
+    mpd_command_list_end(mpd);
+
+    for (size_t i = 0; i < refs->count; i++) {
+        DatabaseJob job = {
+            .id = mpd_recv_update_id(mpd),
+            .ref = refs->data[i],
+        };
+
+        if (job.id == 0) {
+            if (mpd_connection_get_error(mpd) != MPD_ERROR_SERVER) {
+                return false;
+            }
+
+            for (; i < refs->count; i++) {
+                album_mark_ready(refs->data[i].album);
+            }
+            return mpd_connection_clear_error(mpd);
+        }
+
+        list_append(jobs, job);
+        if (!mpd_response_next(mpd)) {
+            return false;
+        }
+    }
+
+    return mpd_response_finish(mpd);
+}
+
+// MPD runs the update jobs one after another, so every job older than the current one is done
+bool database_finish_jobs(struct mpd_connection *mpd, Buffer *buffer, DatabaseJobs *jobs,
+                          AlbumRefs *refs) {
+    struct mpd_status *status = mpd_run_status(mpd);
+    if (!status) {
+        return false;
+    }
+
+    unsigned current = mpd_status_get_update_id(status);
+    mpd_status_free(status);
+
+    size_t count = 0;
+    refs->count = 0;
+    for (size_t i = 0; i < jobs->count; i++) {
+        DatabaseJob job = jobs->data[i];
+        if (current == 0 || job.id < current) {
+            album_refs_push(refs, job.ref);
         } else {
-            popups->begin -= 1;
+            jobs->data[count++] = job;
         }
-        popups->count += 1;
-        popups->slide += POPUP_SLIDEIN;
+    }
+    jobs->count = count;
 
-        Popup *p = popups_first(popups);
-        p->type = type;
-        p->number = number;
-        p->string = string;
-        p->lifetime = POPUP_LIFETIME + popups->slide;
+    if (refs->count == 0) {
+        return true;
+    }
+
+    if (!database_list(mpd, buffer, refs->data, refs->count)) {
+        return false;
     }
+
+    for (size_t i = 0; i < refs->count; i++) {
+        album_mark_ready(refs->data[i].album);
+    }
+
+    return true;
 }
 
-// App
-void scroll_clamp(float *scroll, float wheel, size_t count, size_t height) {
-    *scroll = min(max(*scroll - wheel, 0), max((float)count * ROW_SIZE - height, 0));
+// Wait for MPD to report a change or for somebody to wake the thread up
+bool database_idle(struct mpd_connection *mpd, int wake, int timeout, enum mpd_idle *events) {
+    *events = 0;
+
+    enum mpd_idle mask = MPD_IDLE_DATABASE | MPD_IDLE_UPDATE | MPD_IDLE_PLAYER | MPD_IDLE_QUEUE;
+    if (!mpd_send_idle_mask(mpd, mask)) {
+        return false;
+    }
+
+    struct pollfd fds[] = {
+        {.fd = mpd_connection_get_fd(mpd), .events = POLLIN},
+        {.fd = wake, .events = POLLIN},
+    };
+
+    if (poll(fds, 2, timeout) < 0 && errno != EINTR) {
+        return false;
+    }
+
+    if (fds[0].revents) {
+        *events = mpd_recv_idle(mpd, false);
+        return *events != 0;
+    }
+
+    *events = mpd_run_noidle(mpd);
+    return mpd_connection_get_error(mpd) == MPD_ERROR_SUCCESS;
 }
 
+// Pool
+#define POOL_CAPACITY 2
+#define POOL_TIMEOUT 2000
+#define POOL_BACKOFF_MIN 0.5
+#define POOL_BACKOFF_MAX 30.0
+
+// MPD closes the connections which are not used for connection_timeout, 60 seconds by default
+#define POOL_IDLE 30.0
+
 typedef struct {
-    Library library;
-    Popups popups;
+    pthread_mutex_t lock;
+    struct mpd_connection *data[POOL_CAPACITY];
+    double opened[POOL_CAPACITY];
+    size_t count;
 
-    pid_t download_process;
-    pthread_t download_thread;
+    int wake;
+    bool connected;
+    double retry;
+} Pool;
+
+// Take a ready connection without waiting on MPD. The background thread is woken up to replace it.
+// Connections which sat in the pool for too long are dropped, as MPD might have closed them
+struct mpd_connection *pool_acquire(Pool *pool, double *opened) {
+    struct mpd_connection *mpd = NULL;
+    double now = time_now();
+
+    pthread_mutex_lock(&pool->lock);
+    while (!mpd && pool->count) {
+        pool->count--;
+        mpd = pool->data[pool->count];
+        *opened = pool->opened[pool->count];
+        if (now - *opened > POOL_IDLE) {
+            mpd_connection_free(mpd);
+            mpd = NULL;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
 
-    struct mpd_connection *mpd;
+    if (mpd) {
+        char byte = 0;
+        if (write(pool->wake, &byte, 1) < 0) {
+            // The pipe is full, so the thread is going to wake up anyway
+        }
+    }
 
-    Font font;
-    int glyphs[127 - 32];
+    return mpd;
+}
 
-    Buffer buffer;
-    Vector2 mouse;
-} App;
+// Swap the connection for a fresh one from the pool once it is getting too old, or take one if
+// there is none. Returns the connection to use, NULL if there is none
+struct mpd_connection *pool_renew(Pool *pool, struct mpd_connection *mpd, double *opened) {
+    if (mpd && time_now() - *opened <= POOL_IDLE) {
+        return mpd;
+    }
 
-bool app_execute(App *app, pid_t *process, char *const *args) {
-    pid_t backup = 0;
-    if (!process) {
-        process = &backup;
+    double fresh_opened;
+    struct mpd_connection *fresh = pool_acquire(pool, &fresh_opened);
+    if (!fresh) {
+        return mpd;
+    }
+
+    if (mpd) {
+        mpd_connection_free(mpd);
     }
+    *opened = fresh_opened;
+    return fresh;
+}
+
+// Replace the connections which are getting too old. Returns false if MPD could not be reached
+bool pool_fill(Pool *pool) {
+    double now = time_now();
+
+    pthread_mutex_lock(&pool->lock);
+    size_t count = 0;
+    for (size_t i = 0; i < pool->count; i++) {
+        if (now - pool->opened[i] > POOL_IDLE / 2) {
+            mpd_connection_free(pool->data[i]);
+        } else {
+            pool->data[count] = pool->data[i];
+            pool->opened[count++] = pool->opened[i];
+        }
+    }
+    pool->count = count;
+    pthread_mutex_unlock(&pool->lock);
+
+    while (true) {
+        pthread_mutex_lock(&pool->lock);
+        pool->connected = true;
+        bool full = pool->count >= POOL_CAPACITY;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (full) {
+            return true;
+        }
+
+        struct mpd_connection *mpd = mpd_connection_new(NULL, 0, POOL_TIMEOUT);
+        if (!mpd || mpd_connection_get_error(mpd) != MPD_ERROR_SUCCESS) {
+            if (mpd) {
+                mpd_connection_free(mpd);
+            }
+            return false;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        pool->data[pool->count] = mpd;
+        pool->opened[pool->count++] = time_now();
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+// Milliseconds until pool_fill has to replace a connection, -1 if the pool is empty
+int pool_timeout(Pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    double oldest = pool->count ? pool->opened[0] : 0;
+    for (size_t i = 1; i < pool->count; i++) {
+        oldest = min(oldest, pool->opened[i]);
+    }
+    bool empty = pool->count == 0;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (empty) {
+        return -1;
+    }
+    return max(oldest + POOL_IDLE / 2 - time_now(), 0) * 1000 + 1;
+}
+
+// The pooled connections are most likely dead as well once MPD goes away
+void pool_drain(Pool *pool, double retry) {
+    pthread_mutex_lock(&pool->lock);
+    for (size_t i = 0; i < pool->count; i++) {
+        mpd_connection_free(pool->data[i]);
+    }
+    pool->count = 0;
+    pool->connected = false;
+    pool->retry = retry;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Returns the time of the next reconnect attempt, or zero if MPD is reachable
+double pool_retry(Pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    double retry = pool->connected ? 0 : pool->retry;
+    pthread_mutex_unlock(&pool->lock);
+    return retry;
+}
+
+// Process
+// Signals blocked by the calling thread must not stay blocked in the child
+bool process_spawn(pid_t *process, char *const *args, posix_spawn_file_actions_t *actions) {
+    sigset_t mask;
+    sigemptyset(&mask);
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+    extern char **environ;
+    int error = posix_spawnp(process, *args, actions, &attr, args, environ);
+    posix_spawnattr_destroy(&attr);
+
+    if (error) {
+        *process = 0;
+        return false;
+    }
+
+    return true;
+}
+
+// Returns true if the process exited successfully
+bool process_wait(pid_t process) {
+    int status = 0;
+    while (waitpid(process, &status, 0) == -1) {
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Files
+typedef struct {
+    char **data;
+    size_t count;
+    size_t capacity;
+} Files;
+
+int files_compare(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+void files_free(Files *files) {
+    for (size_t i = 0; i < files->count; i++) {
+        free(files->data[i]);
+    }
+    list_free(files);
+}
+
+// Read the lines of a text file, which is treated as empty if it does not exist
+Files files_load(const char *path) {
+    Files files = {0};
+
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return files;
+    }
+
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t length;
+    while ((length = getline(&line, &size, f)) > 0) {
+        if (line[length - 1] == '\n') {
+            line[length - 1] = '\0';
+        }
+
+        char *copy = strdup(line);
+        list_append(&files, copy);
+    }
+
+    free(line);
+    fclose(f);
+    return files;
+}
+
+// Read the whole file into a null terminated string
+char *file_read(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return NULL;
+    }
+
+    char *data = NULL;
+    long size = -1;
+    if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) >= 0 && fseek(f, 0, SEEK_SET) == 0) {
+        data = malloc(size + 1);
+        assert(data);
+        size = fread(data, 1, size, f);
+        data[size] = '\0';
+    }
+
+    fclose(f);
+    return data;
+}
+
+// FNV-1a over the contents of the file
+bool file_hash(const char *path, uint64_t *hash) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    *hash = HASH_SEED;
+
+    char chunk[1 << 16];
+    ssize_t count;
+    while ((count = read(fd, chunk, sizeof(chunk))) != 0) {
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            close(fd);
+            return false;
+        }
+
+        *hash = hash_bytes(*hash, chunk, count);
+    }
+
+    close(fd);
+    return true;
+}
+
+// Make the file available under another path as well, without copying the data where possible.
+// Hardlinks cannot cross filesystems, reflinks and plain copies can
+bool file_share(const char *source, const char *destination) {
+    if (link(source, destination) == 0) {
+        return true;
+    }
+
+    // Whatever is left at the destination, say a truncated earlier download, is replaced unless it
+    // is the same file already
+    if (errno == EEXIST) {
+        struct stat a, b;
+        if (stat(source, &a) == 0 && stat(destination, &b) == 0 && a.st_dev == b.st_dev &&
+            a.st_ino == b.st_ino) {
+            return true;
+        }
+
+        if (unlink(destination) < 0) {
+            return false;
+        }
+
+        if (link(source, destination) == 0) {
+            return true;
+        }
+    }
+
+    int input = open(source, O_RDONLY | O_CLOEXEC);
+    if (input < 0) {
+        return false;
+    }
+
+    int output = open(destination, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (output < 0) {
+        close(input);
+        return false;
+    }
+
+    bool ok = ioctl(output, FICLONE, input) == 0;
+    if (!ok) {
+        char chunk[1 << 16];
+        ssize_t count;
+
+        ok = true;
+        while (ok && (count = read(input, chunk, sizeof(chunk))) != 0) {
+            if (count < 0) {
+                ok = errno == EINTR;
+                continue;
+            }
+
+            for (ssize_t written = 0; ok && written < count;) {
+                ssize_t n = write(output, chunk + written, count - written);
+                if (n < 0) {
+                    ok = errno == EINTR;
+                } else {
+                    written += n;
+                }
+            }
+        }
+    }
+
+    close(input);
+    if (close(output) < 0 || !ok) {
+        unlink(destination);
+        return false;
+    }
+
+    return true;
+}
+
+// Manifest
+#define MANIFEST_NAME "/.manifest"
+
+typedef enum {
+    VERIFY_NONE,
+    VERIFY_SIZE,
+    VERIFY_HASH,
+} VerifyMode;
+
+// Each album records what its links were downloaded into, as sections of 'size hash file' lines
+// headed by '@link'. A link downloaded again gets a new section, and the last one counts
+typedef struct {
+    AlbumRefs albums;
+    size_t next;
+    VerifyMode mode;
+
+    pthread_mutex_t lock;
+    Links broken;
+} Verifier;
+
+ssize_t verifier_find_link(Album *album, Str value) {
+    for (size_t i = 0; i < album->links.count; i++) {
+        if (str_match(value, album->links.data[i]->value)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool verifier_check(Verifier *verifier, const char *path, long long size, uint64_t hash) {
+    struct stat info;
+    if (stat(path, &info) < 0 || info.st_size != size) {
+        return false;
+    }
+
+    uint64_t actual;
+    return verifier->mode != VERIFY_HASH || (file_hash(path, &actual) && actual == hash);
+}
+
+void verifier_album(Verifier *verifier, AlbumRef ref, Buffer *buffer) {
+    album_ref_path(buffer, "", ref, MANIFEST_NAME);
+    char *data = file_read(buffer->data);
+    if (!data) {
+        return;
+    }
+
+    Album *album = ref.album;
+    size_t *last = calloc(album->links.count + 1, sizeof(size_t));
+    assert(last);
+
+    Str contents = str_from_cstr(data);
+    for (size_t section = 0; contents.size > 0;) {
+        Str line = str_split(&contents, '\n');
+        if (line.size > 0 && *line.data == '@') {
+            section++;
+
+            ssize_t index = verifier_find_link(album, (Str){line.data + 1, line.size - 1});
+            if (index >= 0) {
+                last[index] = section;
+            }
+        }
+    }
+
+    Link *current = NULL;
+    contents = str_from_cstr(data);
+    for (size_t section = 0; contents.size > 0;) {
+        Str line = str_split(&contents, '\n');
+        if (line.size > 0 && *line.data == '@') {
+            section++;
+
+            ssize_t index = verifier_find_link(album, (Str){line.data + 1, line.size - 1});
+            current = index >= 0 && last[index] == section ? album->links.data[index] : NULL;
+            continue;
+        }
+
+        // The file name is the rest of the line, spaces included
+        char *entry = str_to_cstr(line);
+        long long size;
+        unsigned long long hash;
+        int offset = 0;
+        if (!current || !current->ready ||
+            sscanf(entry, "%lld %llx %n", &size, &hash, &offset) != 2 || !offset ||
+            !entry[offset]) {
+            continue;
+        }
+
+        album_ref_path(buffer, "", ref, "/");
+        buffer->count--;
+        buffer_push_string(buffer, entry + offset);
+        list_append(buffer, '\0');
+
+        // The broken file is removed, as yt-dlp would skip it otherwise
+        if (!verifier_check(verifier, buffer->data, size, hash)) {
+            unlink(buffer->data);
+
+            pthread_mutex_lock(&verifier->lock);
+            if (current->ready) {
+                current->ready = false;
+                list_append(&verifier->broken, current);
+            }
+            pthread_mutex_unlock(&verifier->lock);
+        }
+    }
+
+    free(last);
+    free(data);
+}
+
+void *verifier_worker(void *arg) {
+    Verifier *verifier = arg;
+    Buffer buffer = {0};
+
+    while (true) {
+        pthread_mutex_lock(&verifier->lock);
+        size_t next = verifier->next++;
+        pthread_mutex_unlock(&verifier->lock);
+
+        if (next >= verifier->albums.count) {
+            break;
+        }
+
+        verifier_album(verifier, verifier->albums.data[next], &buffer);
+    }
+
+    list_free(&buffer);
+    return NULL;
+}
+
+// Check the files of every downloaded album against its manifest, on all the cores. The links with
+// broken files are pending again, and so are their albums. Returns the broken links
+Links library_verify(Library *library, VerifyMode mode) {
+    Verifier verifier = {.mode = mode};
+    pthread_mutex_init(&verifier.lock, NULL);
+
+    for (size_t i = 0; i < library->count; i++) {
+        Artist *artist = &library->data[i];
+        for (size_t j = 0; j < artist->count; j++) {
+            AlbumRef ref = {
+                .artist = artist,
+                .album = &artist->data[j],
+            };
+
+            // Checking every album needs all of their links anyway
+            library_expand(library, ref.artist, ref.album);
+
+            if (ref.album->links.count) {
+                list_append(&verifier.albums, ref);
+            }
+        }
+    }
+
+    workers_run(verifier_worker, &verifier, verifier.albums.count);
+
+    for (size_t i = 0; i < library->count; i++) {
+        Artist *artist = &library->data[i];
+        for (size_t j = 0; j < artist->count; j++) {
+            Album *album = &artist->data[j];
+            album->ready = album->ready && album_links_ready(album);
+        }
+    }
+    library_count_pending(library);
+
+    pthread_mutex_destroy(&verifier.lock);
+    list_free(&verifier.albums);
+    return verifier.broken;
+}
+
+// Config
+#define CONFIG_ROOT ".config"
+#define CONFIG_POLL 2.0
+
+typedef struct {
+    Link **slot;
+    Link *link;
+} ConfigSlot;
+
+typedef struct {
+    ConfigSlot *data;
+    size_t count;
+    size_t capacity;
+} ConfigSlots;
+
+// A parsed config file, which is only parsed again once its contents change. The library borrows
+// its artists, and the slots remember which of its own links every album link started out as, since
+// the library points them to the shared ones
+typedef struct {
+    char *path;
+    time_t mtime;
+    off_t size;
+    uint64_t hash;
+
+    bool used;
+    bool stale;
+    size_t position;
+
+    Library library;
+    ConfigSlots slots;
+    Error error;
+} ConfigFile;
+
+typedef struct {
+    ConfigFile **data;
+    size_t count;
+    size_t capacity;
+} ConfigFiles;
+
+typedef struct {
+    ConfigFiles files;
+
+    ConfigFiles queue;
+    size_t next;
+    pthread_mutex_t lock;
+} Config;
+
+void config_file_free(ConfigFile *file) {
+    library_free(&file->library);
+    list_free(&file->slots);
+    free(file->path);
+    free(file);
+}
+
+void config_free(Config *config) {
+    for (size_t i = 0; i < config->files.count; i++) {
+        config_file_free(config->files.data[i]);
+    }
+    list_free(&config->files);
+    list_free(&config->queue);
+}
+
+// Find the file in the cache, checking whether it changed since it was parsed
+ConfigFile *config_file(Config *config, const char *path) {
+    ConfigFile *file = NULL;
+    for (size_t i = 0; !file && i < config->files.count; i++) {
+        if (!strcmp(config->files.data[i]->path, path)) {
+            file = config->files.data[i];
+        }
+    }
+
+    if (!file) {
+        file = calloc(1, sizeof(ConfigFile));
+        assert(file);
+        file->path = strdup(path);
+        file->stale = true;
+        list_append(&config->files, file);
+    }
+
+    struct stat info;
+    if (stat(path, &info) < 0 || info.st_mtime != file->mtime || info.st_size != file->size) {
+        file->stale = true;
+    }
+
+    file->used = true;
+    return file;
+}
+
+// Read the file again. A file which was only touched keeps what was parsed out of it
+void config_file_parse(ConfigFile *file, bool lazy) {
+    struct stat info;
+    char *text = file_read(file->path);
+    if (!text || stat(file->path, &info) < 0) {
+        free(text);
+        library_free(&file->library);
+        list_free(&file->slots);
+        file->error = (Error){.path = file->path, .message = "could not read file"};
+        file->mtime = 0;
+        return;
+    }
+
+    uint64_t hash = hash_bytes(HASH_SEED, text, strlen(text));
+
+    bool same = file->library.config && hash == file->hash;
+    file->mtime = info.st_mtime;
+    file->size = info.st_size;
+    file->hash = hash;
+    if (same) {
+        free(text);
+        return;
+    }
+
+    library_free(&file->library);
+    list_free(&file->slots);
+    file->library.config = text;
+    file->library.lazy = lazy;
+
+    file->error = library_parse(&file->library);
+    file->error.path = file->path;
+
+    for (size_t i = 0; i < file->library.count; i++) {
+        Artist *artist = &file->library.data[i];
+        for (size_t j = 0; j < artist->count; j++) {
+            Album *album = &artist->data[j];
+            for (size_t k = 0; k < album->links.count; k++) {
+                ConfigSlot slot = {
+                    .slot = &album->links.data[k],
+                    .link = album->links.data[k],
+                };
+                list_append(&file->slots, slot);
+            }
+        }
+    }
+}
+
+void *config_worker(void *arg) {
+    Config *config = arg;
+    while (true) {
+        pthread_mutex_lock(&config->lock);
+        size_t next = config->next++;
+        pthread_mutex_unlock(&config->lock);
+
+        if (next >= config->queue.count) {
+            break;
+        }
+
+        ConfigFile *file = config->queue.data[next];
+        config_file_parse(file, file->library.lazy);
+        file->stale = false;
+    }
+
+    return NULL;
+}
+
+// Parse the stale files on all the cores
+void config_parse(Config *config, ConfigFiles *files, bool lazy) {
+    config->queue.count = 0;
+    config->next = 0;
+    for (size_t i = 0; i < files->count; i++) {
+        ConfigFile *file = files->data[i];
+        if (file->stale) {
+            file->library.lazy = lazy;
+            list_append(&config->queue, file);
+        }
+    }
+
+    workers_run(config_worker, config, config->queue.count);
+}
+
+// Add the artists of the file to the library. Whatever a previous library expanded or marked in
+// them is undone first
+void config_merge(Library *library, ConfigFile *file, size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+        Artist *artist = &file->library.data[i];
+        for (size_t j = 0; j < artist->count; j++) {
+            Album *album = &artist->data[j];
+            album->ready = false;
+            album->cover = 0;
+            album->scan = SCAN_IDLE;
+
+            if (file->library.lazy && !album->lazy) {
+                album_free(album);
+                album->generated = false;
+                album->lazy = true;
+            } else if (album->generated) {
+                songs_free(&album->songs);
+            }
+        }
+
+        list_append(library, *artist);
+    }
+}
+
+// Load the root config and the files it includes into the library, parsing only the files which
+// changed since the last time. Every included file is parsed independently of the others
+Error config_load(Config *config, Library *library, bool lazy) {
+    pthread_mutex_init(&config->lock, NULL);
+    pthread_mutex_init(&library->lock, NULL);
+    library->lazy = lazy;
+    library->shared = true;
+
+    for (size_t i = 0; i < config->files.count; i++) {
+        config->files.data[i]->used = false;
+    }
+
+    ConfigFile *root = config_file(config, CONFIG_ROOT);
+    ConfigFiles order = {0};
+    list_append(&order, root);
+    config_parse(config, &order, lazy);
+
+    Error error = root->error;
+    order.count = 0;
+
+    Buffer path = {0};
+    for (size_t i = 0; !error.message && i < root->library.includes.count; i++) {
+        Include include = root->library.includes.data[i];
+
+        Files paths = {0};
+        DIR *dir = opendir(include.path);
+        if (dir) {
+            struct dirent *entry;
+            while ((entry = readdir(dir))) {
+                path.count = 0;
+                buffer_push_string(&path, include.path);
+                list_append(&path, '/');
+                buffer_push_string(&path, entry->d_name);
+                list_append(&path, '\0');
+
+                struct stat info;
+                if (*entry->d_name != '.' && !stat(path.data, &info) && S_ISREG(info.st_mode)) {
+                    char *copy = strdup(path.data);
+                    list_append(&paths, copy);
+                }
+            }
+            closedir(dir);
+            qsort(paths.data, paths.count, sizeof(char *), files_compare);
+        } else if (access(include.path, R_OK) == 0) {
+            char *copy = strdup(include.path);
+            list_append(&paths, copy);
+        } else {
+            error = (Error){root->path, include.line, "could not read the included file"};
+        }
+
+        for (size_t j = 0; j < paths.count; j++) {
+            ConfigFile *file = config_file(config, paths.data[j]);
+            file->position = include.position;
+            list_append(&order, file);
+        }
+        files_free(&paths);
+    }
+    list_free(&path);
+
+    if (!error.message) {
+        config_parse(config, &order, lazy);
+    }
+
+    for (size_t i = 0; !error.message && i < order.count; i++) {
+        ConfigFile *file = order.data[i];
+        if (file->error.message) {
+            error = file->error;
+        } else if (file->library.includes.count) {
+            Include include = file->library.includes.data[0];
+            error = (Error){file->path, include.line, "only " CONFIG_ROOT " can include files"};
+        }
+    }
+
+    // Forget the files which are not included anymore
+    size_t count = 0;
+    for (size_t i = 0; i < config->files.count; i++) {
+        ConfigFile *file = config->files.data[i];
+        if (file->used) {
+            config->files.data[count++] = file;
+        } else {
+            config_file_free(file);
+        }
+    }
+    config->files.count = count;
+
+    if (!error.message) {
+        // The included files take the place of the include in the root
+        size_t next = 0;
+        for (size_t i = 0; i < root->library.count; i++) {
+            while (next < order.count && order.data[next]->position == i) {
+                ConfigFile *file = order.data[next++];
+                config_merge(library, file, 0, file->library.count);
+            }
+            config_merge(library, root, i, i + 1);
+        }
+
+        for (; next < order.count; next++) {
+            config_merge(library, order.data[next], 0, order.data[next]->library.count);
+        }
+
+        // Links listed in several files are shared like any other
+        for (size_t i = 0; i < config->files.count; i++) {
+            ConfigSlots *slots = &config->files.data[i]->slots;
+            for (size_t j = 0; j < slots->count; j++) {
+                *slots->data[j].slot = library_add_link(library, slots->data[j].link->value);
+            }
+        }
+
+        for (size_t i = 0; i < library->count; i++) {
+            Artist *artist = &library->data[i];
+            for (size_t j = 0; j < artist->count; j++) {
+                library_own_links(library, artist, &artist->data[j]);
+            }
+        }
+    }
+
+    list_free(&order);
+    pthread_mutex_destroy(&config->lock);
+    return error;
+}
+
+// The latest change to any of the files, or to the directories they are included from
+long config_modified(Config *config) {
+    long modified = GetFileModTime(CONFIG_ROOT);
+    for (size_t i = 0; i < config->files.count; i++) {
+        ConfigFile *file = config->files.data[i];
+        modified = max(modified, GetFileModTime(file->path));
+
+        for (size_t j = 0; j < file->library.includes.count; j++) {
+            modified = max(modified, GetFileModTime(file->library.includes.data[j].path));
+        }
+    }
+
+    return modified;
+}
+
+// Covers
+#define COVERS_CAPACITY 256
+#define COVERS_WORKERS 2
+#define COVERS_UPLOADS 4
+#define COVERS_STALE 30
+#define COVERS_DIRECTORY ".thumbnails"
+#define COVER_SIZE (ROW_SIZE - 4)
+
+typedef enum {
+    COVER_EMPTY,
+    COVER_QUEUED,
+    COVER_DECODED,
+    COVER_READY,
+    COVER_MISSING,
+} CoverState;
+
+typedef struct {
+    CoverState state;
+    Artist *artist;
+    Album *album;
+
+    Image image;
+    Texture2D texture;
+    size_t used;
+} Cover;
+
+// Thumbnails are decoded by the workers and uploaded by the render thread, a few per frame. Albums
+// refer to their entry by index plus one, so that zero means none
+typedef struct {
+    Cover items[COVERS_CAPACITY];
+    size_t frame;
+
+    size_t jobs[COVERS_CAPACITY];
+    size_t count;
+
+    pthread_t workers[COVERS_WORKERS];
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool quit;
+} Covers;
+
+uint64_t cover_hash(const char *a, const char *b) {
+    uint64_t hash = hash_bytes(HASH_SEED, a, strlen(a));
+    hash = hash_bytes(hash, "/", 1);
+    return hash_bytes(hash, b, strlen(b));
+}
+
+// Load the thumbnail of an album, generating it from 'Artist/Album/cover.png' unless the one cached
+// on disk is still up to date. raylib is built without JPEG support, so covers have to be PNGs
+Image cover_load(Artist *artist, Album *album) {
+    char source[4096];
+    snprintf(source, sizeof(source), "%s/%s/cover.png", artist->name, album->name);
+
+    struct stat info;
+    if (stat(source, &info) < 0) {
+        return (Image){0};
+    }
+
+    char thumbnail[64];
+    snprintf(thumbnail, sizeof(thumbnail), COVERS_DIRECTORY "/%016llx.png",
+             (unsigned long long)cover_hash(artist->name, album->name));
+
+    struct stat cached;
+    if (stat(thumbnail, &cached) == 0 && cached.st_mtime >= info.st_mtime) {
+        Image image = LoadImage(thumbnail);
+        if (image.data) {
+            return image;
+        }
+    }
+
+    Image image = LoadImage(source);
+    if (!image.data) {
+        return image;
+    }
+
+    int side = min(image.width, image.height);
+    ImageCrop(&image, (Rectangle){(image.width - side) / 2, (image.height - side) / 2, side, side});
+    ImageResize(&image, COVER_SIZE, COVER_SIZE);
+    ImageFormat(&image, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+
+    mkdir(COVERS_DIRECTORY, 0755);
+    ExportImage(image, thumbnail);
+    return image;
+}
+
+void *covers_worker(void *arg) {
+    Covers *covers = arg;
+
+    pthread_mutex_lock(&covers->lock);
+    while (true) {
+        while (!covers->count && !covers->quit) {
+            pthread_cond_wait(&covers->cond, &covers->lock);
+        }
+
+        if (covers->quit) {
+            break;
+        }
+
+        // The most recent requests are the ones on screen. Albums which were scrolled out of view
+        // before their turn came are dropped
+        Cover *cover = &covers->items[covers->jobs[--covers->count]];
+        if (covers->frame - cover->used > COVERS_STALE) {
+            cover->album->cover = 0;
+            cover->state = COVER_EMPTY;
+            continue;
+        }
+
+        Artist *artist = cover->artist;
+        Album *album = cover->album;
+        pthread_mutex_unlock(&covers->lock);
+
+        Image image = cover_load(artist, album);
+
+        pthread_mutex_lock(&covers->lock);
+        cover->image = image;
+        cover->state = image.data ? COVER_DECODED : COVER_MISSING;
+    }
+    pthread_mutex_unlock(&covers->lock);
+
+    return NULL;
+}
+
+bool covers_start(Covers *covers) {
+    for (size_t i = 0; i < COVERS_WORKERS; i++) {
+        if (pthread_create(&covers->workers[i], NULL, covers_worker, covers)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void covers_stop(Covers *covers) {
+    pthread_mutex_lock(&covers->lock);
+    covers->quit = true;
+    pthread_cond_broadcast(&covers->cond);
+    pthread_mutex_unlock(&covers->lock);
+
+    for (size_t i = 0; i < COVERS_WORKERS; i++) {
+        if (covers->workers[i]) {
+            pthread_join(covers->workers[i], NULL);
+        }
+    }
+
+    for (size_t i = 0; i < COVERS_CAPACITY; i++) {
+        Cover *cover = &covers->items[i];
+        if (cover->state == COVER_DECODED) {
+            UnloadImage(cover->image);
+        } else if (cover->state == COVER_READY) {
+            UnloadTexture(cover->texture);
+        }
+    }
+
+    // Ready to be started again
+    memset(covers->items, 0, sizeof(covers->items));
+    memset(covers->workers, 0, sizeof(covers->workers));
+    covers->count = 0;
+    covers->quit = false;
+}
+
+// Returns the texture of the album if it is loaded, requesting it otherwise. When the cache is full
+// the least recently drawn thumbnail makes room
+Texture2D *covers_get(Covers *covers, Artist *artist, Album *album) {
+    Texture2D *texture = NULL;
+
+    pthread_mutex_lock(&covers->lock);
+    if (album->cover) {
+        Cover *cover = &covers->items[album->cover - 1];
+        cover->used = covers->frame;
+        if (cover->state == COVER_READY) {
+            texture = &cover->texture;
+        }
+
+        pthread_mutex_unlock(&covers->lock);
+        return texture;
+    }
+
+    Cover *oldest = NULL;
+    for (size_t i = 0; i < COVERS_CAPACITY; i++) {
+        Cover *cover = &covers->items[i];
+        if (cover->state == COVER_EMPTY) {
+            oldest = cover;
+            break;
+        }
+
+        bool evictable = cover->state == COVER_READY || cover->state == COVER_MISSING;
+        if (evictable && cover->used < covers->frame && (!oldest || cover->used < oldest->used)) {
+            oldest = cover;
+        }
+    }
+
+    if (oldest) {
+        if (oldest->state == COVER_READY) {
+            UnloadTexture(oldest->texture);
+        }
+
+        if (oldest->album) {
+            oldest->album->cover = 0;
+        }
+
+        oldest->state = COVER_QUEUED;
+        oldest->artist = artist;
+        oldest->album = album;
+        oldest->used = covers->frame;
+
+        album->cover = oldest - covers->items + 1;
+        covers->jobs[covers->count++] = oldest - covers->items;
+        pthread_cond_signal(&covers->cond);
+    }
+
+    pthread_mutex_unlock(&covers->lock);
+    return texture;
+}
+
+// Upload a bounded number of decoded thumbnails, must be called once per frame
+void covers_upload(Covers *covers) {
+    pthread_mutex_lock(&covers->lock);
+    covers->frame++;
+
+    size_t uploads = 0;
+    for (size_t i = 0; i < COVERS_CAPACITY && uploads < COVERS_UPLOADS; i++) {
+        Cover *cover = &covers->items[i];
+        if (cover->state == COVER_DECODED) {
+            cover->texture = LoadTextureFromImage(cover->image);
+            UnloadImage(cover->image);
+            cover->state = COVER_READY;
+            uploads++;
+        }
+    }
+    pthread_mutex_unlock(&covers->lock);
+}
+
+// Scanner
+#define SCANNER_WORKERS 4
+#define SCANNER_CACHE ".metadata"
+
+typedef struct {
+    char *path;
+    time_t mtime;
+    off_t size;
+    float duration;
+} ScannerEntry;
+
+// Sorted by path, read only once the workers are running
+typedef struct {
+    ScannerEntry *data;
+    size_t count;
+    size_t capacity;
+} ScannerCache;
+
+typedef struct {
+    AlbumRefs jobs;
+    ScannerCache cache;
+
+    // Song lists replaced while somebody else might still be reading them
+    struct {
+        Songs *data;
+        size_t count;
+        size_t capacity;
+    } retired;
+
+    pthread_t workers[SCANNER_WORKERS];
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool quit;
+} Scanner;
+
+int scanner_entry_compare(const void *a, const void *b) {
+    return strcmp(((const ScannerEntry *)a)->path, ((const ScannerEntry *)b)->path);
+}
+
+// Each line is 'mtime size duration path', where a negative duration marks a corrupt file
+void scanner_load(Scanner *scanner, const char *path) {
+    char *contents = LoadFileText(path);
+    if (!contents) {
+        return;
+    }
+
+    Str str = str_from_cstr(contents);
+    while (str.size > 0) {
+        char *line = str_to_cstr(str_split(&str, '\n'));
+
+        long long mtime, size;
+        float duration;
+        int offset = 0;
+        if (sscanf(line, "%lld %lld %f %n", &mtime, &size, &duration, &offset) == 3 && offset) {
+            ScannerEntry entry = {
+                .path = strdup(line + offset),
+                .mtime = mtime,
+                .size = size,
+                .duration = duration,
+            };
+            list_append(&scanner->cache, entry);
+        }
+    }
+    UnloadFileText(contents);
+
+    qsort(scanner->cache.data, scanner->cache.count, sizeof(ScannerEntry), scanner_entry_compare);
+}
+
+ScannerEntry *scanner_find(Scanner *scanner, const char *path) {
+    ScannerEntry key = {.path = (char *)path};
+    return bsearch(&key, scanner->cache.data, scanner->cache.count, sizeof(ScannerEntry),
+                   scanner_entry_compare);
+}
+
+// Albums which were never expanded keep whatever the cache had for them
+void scanner_save_cached(Scanner *scanner, FILE *f, Buffer *prefix) {
+    ScannerCache *cache = &scanner->cache;
+
+    size_t low = 0, high = cache->count;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (strcmp(cache->data[middle].path, prefix->data) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    for (size_t i = low; i < cache->count; i++) {
+        ScannerEntry *entry = &cache->data[i];
+        if (strncmp(entry->path, prefix->data, prefix->count - 1)) {
+            break;
+        }
+
+        fprintf(f, "%lld %lld %g %s\n", (long long)entry->mtime, (long long)entry->size,
+                entry->duration, entry->path);
+    }
+}
+
+bool scanner_save(Scanner *scanner, Library *library, const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        return false;
+    }
+
+    Buffer prefix = {0};
+    for (size_t i = 0; i < library->count; i++) {
+        Artist *artist = &library->data[i];
+        for (size_t j = 0; j < artist->count; j++) {
+            Album *album = &artist->data[j];
+            if (album->lazy) {
+                AlbumRef ref = {
+                    .artist = artist,
+                    .album = album,
+                };
+
+                album_ref_path(&prefix, "", ref, "/");
+                scanner_save_cached(scanner, f, &prefix);
+            }
+
+            for (size_t k = 0; k < album->songs.count; k++) {
+                Song *song = &album->songs.data[k];
+
+                // Songs the workers did not get to yet keep what the cache had for them
+                if (song->status != SONG_OK && song->status != SONG_CORRUPT) {
+                    AlbumRef ref = {
+                        .artist = artist,
+                        .album = album,
+                    };
+
+                    album_ref_path(&prefix, "", ref, "/");
+                    prefix.count--;
+                    buffer_push_string(&prefix, song->path);
+                    list_append(&prefix, '\0');
+
+                    ScannerEntry *entry = scanner_find(scanner, prefix.data);
+                    if (entry) {
+                        fprintf(f, "%lld %lld %g %s\n", (long long)entry->mtime,
+                                (long long)entry->size, entry->duration, entry->path);
+                    }
+                    continue;
+                }
+
+                // Files which could not be probed are tried again next time
+                float duration = song->status == SONG_CORRUPT ? -1 : song->duration;
+                if (song->status == SONG_CORRUPT || duration > 0) {
+                    fprintf(f, "%lld %lld %g %s/%s/%s\n", (long long)song->mtime,
+                            (long long)song->size, duration, artist->name, album->name,
+                            song->path);
+                }
+            }
+        }
+    }
+    list_free(&prefix);
+
+    fclose(f);
+    return true;
+}
+
+// Ask ffprobe for the duration of the file. Returns SONG_UNKNOWN if it could not be run at all
+SongStatus scanner_probe(const char *path, float *duration) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        return SONG_UNKNOWN;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+
+    char *const args[] = {
+        "ffprobe", "-v", "error", "-show_entries", "format=duration", "-of", "csv=p=0",
+        (char *)path, NULL,
+    };
+
+    pid_t process;
+    bool spawned = process_spawn(&process, args, &actions);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+
+    char output[64];
+    size_t size = 0;
+    if (spawned) {
+        ssize_t n;
+        while (size < sizeof(output) - 1 &&
+               ((n = read(fds[0], output + size, sizeof(output) - 1 - size)) > 0 ||
+                (n < 0 && errno == EINTR))) {
+            size += max(n, 0);
+        }
+    }
+    output[size] = '\0';
+    close(fds[0]);
+
+    if (!spawned) {
+        return SONG_UNKNOWN;
+    }
+
+    char *end;
+    *duration = strtof(output, &end);
+    if (!process_wait(process) || end == output || *duration <= 0) {
+        *duration = 0;
+        return SONG_CORRUPT;
+    }
+
+    return SONG_OK;
+}
+
+bool scanner_audio(const char *file) {
+    const char *extensions[] = {
+        ".aac", ".flac", ".m4a", ".mka", ".mp3", ".ogg", ".opus", ".wav", ".webm",
+    };
+
+    const char *extension = strrchr(file, '.');
+    if (*file == '.' || !extension) {
+        return false;
+    }
+
+    for (size_t i = 0; i < sizeof(extensions) / sizeof(*extensions); i++) {
+        if (!strcmp(extension, extensions[i])) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void scanner_song_push(Songs *songs, const char *file) {
+    for (size_t i = 0; i < songs->count; i++) {
+        if (!strcmp(songs->data[i].path, file)) {
+            return;
+        }
+    }
+
+    Song song = {
+        .name = strndup(file, strrchr(file, '.') - file),
+        .path = strdup(file),
+    };
+    list_append(songs, song);
+}
+
+// List the audio files in the directory of the album. Those which yt-dlp recorded in '.tracks' come
+// first in the order they were downloaded in, the rest follow sorted by name
+Songs scanner_list(Buffer *buffer, size_t prefix) {
+    Songs songs = {0};
+
+    buffer->count = prefix;
+    list_append(buffer, '\0');
+
+    DIR *dir = opendir(buffer->data);
+    if (!dir) {
+        return songs;
+    }
+
+    Files files = {0};
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        if (scanner_audio(entry->d_name)) {
+            char *file = strdup(entry->d_name);
+            list_append(&files, file);
+        }
+    }
+    closedir(dir);
+    qsort(files.data, files.count, sizeof(char *), files_compare);
+
+    buffer->count = prefix;
+    buffer_push_string(buffer, ".tracks");
+    list_append(buffer, '\0');
+
+    FILE *f = fopen(buffer->data, "r");
+    if (f) {
+        char *line = NULL;
+        size_t size = 0;
+        ssize_t length;
+        while ((length = getline(&line, &size, f)) > 0) {
+            if (line[length - 1] == '\n') {
+                line[length - 1] = '\0';
+            }
+
+            char *file = strrchr(line, '/');
+            file = file ? file + 1 : line;
+            if (bsearch(&file, files.data, files.count, sizeof(char *), files_compare)) {
+                scanner_song_push(&songs, file);
+            }
+        }
+        free(line);
+        fclose(f);
+    }
+
+    for (size_t i = 0; i < files.count; i++) {
+        scanner_song_push(&songs, files.data[i]);
+    }
+    files_free(&files);
+
+    return songs;
+}
+
+// Replace the songs of the album unless nothing changed. The old list stays around until exit,
+// since the other threads do not lock the library to read it
+void scanner_publish(Scanner *scanner, Album *album, Songs songs) {
+    Songs old = album->songs;
+    bool same = songs.count == old.count;
+    for (size_t i = 0; same && i < songs.count; i++) {
+        same = !strcmp(songs.data[i].path, old.data[i].path);
+    }
+
+    if (same) {
+        songs_free(&songs);
+        return;
+    }
+
+    album_publish_songs(album, songs);
+
+    pthread_mutex_lock(&scanner->lock);
+    list_append(&scanner->retired, old);
+    pthread_mutex_unlock(&scanner->lock);
+}
+
+void scanner_album(Scanner *scanner, AlbumRef ref, Buffer *buffer) {
+    database_album_path(buffer, ref);
+    buffer->count--;
+    list_append(buffer, '/');
+    size_t prefix = buffer->count;
+
+    Album *album = ref.album;
+    if (album->generated) {
+        scanner_publish(scanner, album, scanner_list(buffer, prefix));
+    }
+
+    Songs songs = album_songs(album);
+    for (size_t i = 0; i < songs.count && !scanner->quit; i++) {
+        Song *song = &songs.data[i];
+
+        buffer->count = prefix;
+        buffer_push_string(buffer, song->path);
+        list_append(buffer, '\0');
+
+        struct stat info;
+        if (stat(buffer->data, &info) < 0) {
+            song->status = SONG_ABSENT;
+            continue;
+        }
+
+        song->size = info.st_size;
+        song->mtime = info.st_mtime;
+
+        // Only the files which changed since the last scan have to be probed
+        ScannerEntry *entry = scanner_find(scanner, buffer->data);
+        if (entry && entry->mtime == song->mtime && entry->size == song->size) {
+            song->duration = max(entry->duration, 0);
+            song->status = entry->duration < 0 ? SONG_CORRUPT : SONG_OK;
+            continue;
+        }
+
+        float duration = 0;
+        SongStatus status = scanner_probe(buffer->data, &duration);
+        song->duration = duration;
+        song->status = status == SONG_UNKNOWN ? SONG_OK : status;
+    }
+}
+
+// Must be called with the lock held. An album which is being scanned is scanned again afterwards
+void scanner_queue(Scanner *scanner, AlbumRef ref) {
+    if (ref.album->scan == SCAN_IDLE) {
+        ref.album->scan = SCAN_QUEUED;
+        list_append(&scanner->jobs, ref);
+    } else if (ref.album->scan == SCAN_RUNNING) {
+        ref.album->scan = SCAN_AGAIN;
+    }
+}
+
+void *scanner_worker(void *arg) {
+    Scanner *scanner = arg;
+    Buffer buffer = {0};
+
+    pthread_mutex_lock(&scanner->lock);
+    while (true) {
+        while (!scanner->jobs.count && !scanner->quit) {
+            pthread_cond_wait(&scanner->cond, &scanner->lock);
+        }
+
+        if (scanner->quit) {
+            break;
+        }
+
+        AlbumRef ref = scanner->jobs.data[--scanner->jobs.count];
+        ref.album->scan = SCAN_RUNNING;
+        pthread_mutex_unlock(&scanner->lock);
+
+        scanner_album(scanner, ref, &buffer);
+
+        pthread_mutex_lock(&scanner->lock);
+        bool again = ref.album->scan == SCAN_AGAIN;
+        ref.album->scan = SCAN_IDLE;
+        if (again) {
+            scanner_queue(scanner, ref);
+        }
+    }
+    pthread_mutex_unlock(&scanner->lock);
+
+    list_free(&buffer);
+    return NULL;
+}
+
+// Scan every album of the library, the first ones in the config first
+bool scanner_start(Scanner *scanner, Library *library) {
+    scanner_load(scanner, SCANNER_CACHE);
+
+    pthread_mutex_lock(&scanner->lock);
+    for (size_t i = library->count; i > 0; i--) {
+        Artist *artist = &library->data[i - 1];
+        for (size_t j = artist->count; j > 0; j--) {
+            AlbumRef ref = {
+                .artist = artist,
+                .album = &artist->data[j - 1],
+            };
+            scanner_queue(scanner, ref);
+        }
+    }
+    pthread_mutex_unlock(&scanner->lock);
+
+    for (size_t i = 0; i < SCANNER_WORKERS; i++) {
+        if (pthread_create(&scanner->workers[i], NULL, scanner_worker, scanner)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Scan the album again, for when its files changed
+void scanner_push(Scanner *scanner, Artist *artist, Album *album) {
+    AlbumRef ref = {
+        .artist = artist,
+        .album = album,
+    };
+
+    pthread_mutex_lock(&scanner->lock);
+    scanner_queue(scanner, ref);
+    pthread_cond_signal(&scanner->cond);
+    pthread_mutex_unlock(&scanner->lock);
+}
+
+void scanner_stop(Scanner *scanner) {
+    pthread_mutex_lock(&scanner->lock);
+    scanner->quit = true;
+    pthread_cond_broadcast(&scanner->cond);
+    pthread_mutex_unlock(&scanner->lock);
+
+    for (size_t i = 0; i < SCANNER_WORKERS; i++) {
+        if (scanner->workers[i]) {
+            pthread_join(scanner->workers[i], NULL);
+            scanner->workers[i] = 0;
+        }
+    }
+    scanner->quit = false;
+}
+
+void scanner_free(Scanner *scanner) {
+    for (size_t i = 0; i < scanner->cache.count; i++) {
+        free(scanner->cache.data[i].path);
+    }
+    list_free(&scanner->cache);
+    list_free(&scanner->jobs);
+
+    for (size_t i = 0; i < scanner->retired.count; i++) {
+        songs_free(&scanner->retired.data[i]);
+    }
+    list_free(&scanner->retired);
+}
+
+// Control
+#define CONTROL_PATH ".control"
+#define CONTROL_CLIENTS 8
+#define CONTROL_LINE_MAX 4096
+
+typedef struct {
+    int fd;
+    Buffer input;
+} ControlClient;
+
+typedef struct {
+    pthread_t thread;
+    int wake[2];
+    int server;
+
+    ControlClient clients[CONTROL_CLIENTS];
+    size_t count;
+
+    struct mpd_connection *mpd;
+    double opened;
+    size_t batch;
+    char error[256];
+
+    Buffer output;
+    Buffer buffer;
+} Control;
+
+void control_reply(Control *control, const char *first, const char *second) {
+    buffer_push_string(&control->output, first);
+    if (second) {
+        buffer_push_string(&control->output, second);
+    }
+    list_append(&control->output, '\n');
+}
+
+// Popups
+typedef enum {
+    POPUP_STARTED,
+    POPUP_DOWNLOAD_OK,
+    POPUP_QUEUED,
+    POPUP_CONTINUOUS,
+    POPUP_RELOAD_PENDING,
+    POPUP_DOWNLOAD_ERROR,
+    POPUP_VERIFY_ERROR,
+    POPUP_CONFIG_ERROR,
+    POPUP_GENERAL_ERROR,
+} PopupType;
+
+bool popup_type_error(PopupType type) {
+    return type >= POPUP_DOWNLOAD_ERROR;
+}
+
+Color popup_type_color(PopupType type) {
+    if (!popup_type_error(type)) {
+        return SUCCESS_COLOR;
+    }
+
+    return ERROR_COLOR;
+}
+
+#define POPUP_TEXT_MAX 256
+
+// The text is rendered once when the popup is pushed, and measured again only when the space
+// available for it changes
+typedef struct {
+    PopupType type;
+    char text[POPUP_TEXT_MAX];
+
+    int bound;
+    size_t end;
+    size_t width;
+
+    float lifetime;
+} Popup;
+
+// Format the text of the popup, cut short without splitting a character if it does not fit
+void popup_render(PopupType type, size_t number, const char *string, char *text) {
+    switch (type) {
+    case POPUP_STARTED:
+        snprintf(text, POPUP_TEXT_MAX, "%zu %s%s started", number, string, number != 1 ? "s" : "");
+        break;
+
+    case POPUP_DOWNLOAD_OK:
+        snprintf(text, POPUP_TEXT_MAX, "Downloaded %s", string);
+        break;
+
+    case POPUP_QUEUED:
+        snprintf(text, POPUP_TEXT_MAX, "Queued %s", string);
+        break;
+
+    case POPUP_CONTINUOUS:
+        snprintf(text, POPUP_TEXT_MAX, "Continuous play %s", number ? "on" : "off");
+        break;
+
+    case POPUP_RELOAD_PENDING:
+        snprintf(text, POPUP_TEXT_MAX, "Config reloads once the downloads are done");
+        break;
+
+    case POPUP_DOWNLOAD_ERROR:
+        snprintf(text, POPUP_TEXT_MAX, "Could not download %s", string);
+        break;
+
+    case POPUP_VERIFY_ERROR:
+        snprintf(text, POPUP_TEXT_MAX, "Broken download %s", string);
+        break;
+
+    case POPUP_CONFIG_ERROR:
+        snprintf(text, POPUP_TEXT_MAX, "%s in line %zu", string, number);
+        break;
+
+    case POPUP_GENERAL_ERROR:
+        snprintf(text, POPUP_TEXT_MAX, "%s", string);
+        break;
+    }
+
+    size_t length = strlen(text);
+    if (length == POPUP_TEXT_MAX - 1) {
+        size_t lead = length;
+        while (lead > 0 && ((unsigned char)text[lead - 1] & 0xC0) == 0x80) {
+            lead--;
+        }
+
+        unsigned char byte = lead > 0 ? text[lead - 1] : 0;
+        size_t size = byte >= 0xF0 ? 4 : byte >= 0xE0 ? 3 : byte >= 0xC0 ? 2 : 1;
+        if (lead > 0 && lead - 1 + size > length) {
+            text[lead - 1] = '\0';
+        }
+    }
+}
+
+void log_begin(FILE *f, const char *level, const char *event) {
+    char stamp[32];
+    time_t now = time(NULL);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+    fprintf(f, "time=%s level=%s event=%s", stamp, level, event);
+}
+
+void log_value(FILE *f, const char *key, const char *value) {
+    fprintf(f, " %s=\"", key);
+    for (const char *p = value; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            fputc('\\', f);
+        }
+        fputc(*p, f);
+    }
+    fputc('"', f);
+}
+
+// Write the popup as a logfmt line, for when there is no window to show it in
+void popup_log(PopupType type, size_t number, const char *string, FILE *f) {
+    const char *level = popup_type_error(type) ? "error" : "info";
+    switch (type) {
+    case POPUP_STARTED:
+        log_begin(f, level, "started");
+        fprintf(f, " count=%zu", number);
+        log_value(f, "what", string);
+        break;
+
+    case POPUP_DOWNLOAD_OK:
+        log_begin(f, level, "download_ok");
+        log_value(f, "link", string);
+        break;
+
+    case POPUP_QUEUED:
+        log_begin(f, level, "queued");
+        log_value(f, "album", string);
+        break;
+
+    case POPUP_CONTINUOUS:
+        log_begin(f, level, "continuous");
+        fprintf(f, " enabled=%s", number ? "true" : "false");
+        break;
+
+    case POPUP_RELOAD_PENDING:
+        log_begin(f, level, "reload_pending");
+        break;
+
+    case POPUP_DOWNLOAD_ERROR:
+        log_begin(f, level, "download_error");
+        log_value(f, "link", string);
+        break;
+
+    case POPUP_VERIFY_ERROR:
+        log_begin(f, level, "verify_error");
+        log_value(f, "link", string);
+        break;
+
+    case POPUP_CONFIG_ERROR:
+        log_begin(f, level, "config_error");
+        fprintf(f, " line=%zu", number);
+        log_value(f, "message", string);
+        break;
+
+    case POPUP_GENERAL_ERROR:
+        log_begin(f, level, "error");
+        log_value(f, "message", string);
+        break;
+    }
+    fputc('\n', f);
+}
+
+#define POPUP_SLIDEIN 0.1
+#define POPUP_LIFETIME 4.0
+
+#define POPUPS_CAPACITY 20
+
+#define popups_get(p, index)                                                                       \
+    (assert(index < (p)->count), &(p)->items[((p)->begin + index) % POPUPS_CAPACITY])
+
+#define popups_first(p) popups_get((p), 0)
+#define popups_last(p) popups_get((p), (p)->count - 1)
+
+// Popups are pushed from the background threads as well as the main one
+typedef struct {
+    Popup items[POPUPS_CAPACITY];
+    size_t begin;
+    size_t count;
+    float slide;
+    pthread_mutex_t lock;
+} Popups;
+
+void popups_push(Popups *popups, PopupType type, size_t number, const char *string) {
+    pthread_mutex_lock(&popups->lock);
+    if (popups->count < POPUPS_CAPACITY) {
+        if (popups->begin == 0) {
+            popups->begin = POPUPS_CAPACITY - 1;
+        } else {
+            popups->begin -= 1;
+        }
+        popups->count += 1;
+        popups->slide += POPUP_SLIDEIN;
+
+        Popup *p = popups_first(popups);
+        p->type = type;
+        p->bound = 0;
+        p->lifetime = POPUP_LIFETIME + popups->slide;
+        popup_render(type, number, string, p->text);
+    }
+    pthread_mutex_unlock(&popups->lock);
+}
+
+// Glyphs
+#define GLYPHS_ATLAS_SIZE 512
+#define GLYPHS_PADDING 1
+
+typedef struct {
+    int codepoint;
+    int advance;
+    int offset_x;
+    int offset_y;
+    Rectangle rect;
+} Glyph;
+
+typedef struct {
+    Glyph *data;
+    size_t count;
+    size_t capacity;
+
+    // Open addressing table of glyph indices offset by one, so that zero is empty
+    size_t *table;
+    size_t table_size;
+
+    // Shelf packed atlas which only grows in height
+    unsigned char *pixels;
+    int width;
+    int height;
+    int x;
+    int y;
+    int row;
+
+    Texture2D texture;
+
+    // Textures replaced during the frame, which its batched draw calls might still reference
+    struct {
+        Texture2D *data;
+        size_t count;
+        size_t capacity;
+    } retired;
+} Glyphs;
+
+size_t glyphs_hash(int codepoint, size_t size) {
+    return ((unsigned)codepoint * 2654435761u) & (size - 1);
+}
+
+Glyph *glyphs_find(Glyphs *glyphs, int codepoint) {
+    if (glyphs->table_size == 0) {
+        return NULL;
+    }
+
+    size_t i = glyphs_hash(codepoint, glyphs->table_size);
+    while (glyphs->table[i]) {
+        Glyph *glyph = &glyphs->data[glyphs->table[i] - 1];
+        if (glyph->codepoint == codepoint) {
+            return glyph;
+        }
+        i = (i + 1) & (glyphs->table_size - 1);
+    }
+
+    return NULL;
+}
+
+void glyphs_insert(Glyphs *glyphs, Glyph glyph) {
+    list_append(glyphs, glyph);
+
+    if (glyphs->count * 2 > glyphs->table_size) {
+        free(glyphs->table);
+        glyphs->table_size = glyphs->table_size ? glyphs->table_size * 2 : LIST_INIT_CAP;
+        glyphs->table = calloc(glyphs->table_size, sizeof(*glyphs->table));
+        assert(glyphs->table);
+
+        for (size_t i = 0; i + 1 < glyphs->count; i++) {
+            size_t j = glyphs_hash(glyphs->data[i].codepoint, glyphs->table_size);
+            while (glyphs->table[j]) {
+                j = (j + 1) & (glyphs->table_size - 1);
+            }
+            glyphs->table[j] = i + 1;
+        }
+    }
+
+    size_t i = glyphs_hash(glyph.codepoint, glyphs->table_size);
+    while (glyphs->table[i]) {
+        i = (i + 1) & (glyphs->table_size - 1);
+    }
+    glyphs->table[i] = glyphs->count;
+}
+
+Texture2D glyphs_upload(Glyphs *glyphs) {
+    Image image = {
+        .data = glyphs->pixels,
+        .width = glyphs->width,
+        .height = glyphs->height,
+        .mipmaps = 1,
+        .format = PIXELFORMAT_UNCOMPRESSED_GRAY_ALPHA,
+    };
+
+    return LoadTextureFromImage(image);
+}
+
+// Reserve space in the atlas. Growing it replaces the texture, but the old one might still be
+// referenced by the draw calls batched so far, so it is only released after the frame. The atlas
+// can grow more than once in a frame, so every texture replaced in it is kept until then
+Rectangle glyphs_pack(Glyphs *glyphs, int width, int height) {
+    if (glyphs->x + width + GLYPHS_PADDING > glyphs->width) {
+        glyphs->x = GLYPHS_PADDING;
+        glyphs->y += glyphs->row + GLYPHS_PADDING;
+        glyphs->row = 0;
+    }
+
+    if (glyphs->y + height + GLYPHS_PADDING > glyphs->height) {
+        size_t size = (size_t)glyphs->width * glyphs->height * 2;
+        glyphs->pixels = realloc(glyphs->pixels, size * 2);
+        assert(glyphs->pixels);
+        memset(glyphs->pixels + size, 0, size);
+        glyphs->height *= 2;
+
+        list_append(&glyphs->retired, glyphs->texture);
+        glyphs->texture = glyphs_upload(glyphs);
+    }
+
+    Rectangle rect = {glyphs->x, glyphs->y, width, height};
+    glyphs->x += width + GLYPHS_PADDING;
+    glyphs->row = max(glyphs->row, height);
+    return rect;
+}
+
+void glyphs_rasterize(Glyphs *glyphs, int *codepoints, int count) {
+    GlyphInfo *infos = LoadFontData(font, font_len, FONT_SIZE, codepoints, count, FONT_DEFAULT);
+    if (!infos) {
+        return;
+    }
+
+    for (int i = 0; i < count; i++) {
+        GlyphInfo *info = &infos[i];
+        Glyph glyph = {
+            .codepoint = codepoints[i],
+            .advance = info->advanceX ? info->advanceX : info->image.width,
+            .offset_x = info->offsetX,
+            .offset_y = info->offsetY,
+        };
+
+        int width = info->image.data ? info->image.width : 0;
+        int height = info->image.data ? info->image.height : 0;
+        if (width > 0 && height > 0) {
+            glyph.rect = glyphs_pack(glyphs, width, height);
+
+            unsigned char *region = malloc((size_t)width * height * 2);
+            assert(region);
+
+            const unsigned char *alpha = info->image.data;
+            for (int y = 0; y < height; y++) {
+                size_t line = ((size_t)(glyph.rect.y + y) * glyphs->width + (int)glyph.rect.x) * 2;
+                for (int x = 0; x < width; x++) {
+                    unsigned char *pixel = &region[(y * width + x) * 2];
+                    pixel[0] = 0xFF;
+                    pixel[1] = alpha[y * width + x];
+                    memcpy(&glyphs->pixels[line + x * 2], pixel, 2);
+                }
+            }
+
+            UpdateTextureRec(glyphs->texture, glyph.rect, region);
+            free(region);
+        }
+
+        glyphs_insert(glyphs, glyph);
+    }
+
+    UnloadFontData(infos, count);
+}
+
+void glyphs_init(Glyphs *glyphs) {
+    glyphs->width = GLYPHS_ATLAS_SIZE;
+    glyphs->height = GLYPHS_ATLAS_SIZE;
+    glyphs->x = GLYPHS_PADDING;
+    glyphs->y = GLYPHS_PADDING;
+
+    glyphs->pixels = calloc((size_t)glyphs->width * glyphs->height, 2);
+    assert(glyphs->pixels);
+    glyphs->texture = glyphs_upload(glyphs);
+
+    int ascii[127 - 32];
+    for (int i = 0; i < 127 - 32; i++) {
+        ascii[i] = i + 32;
+    }
+    glyphs_rasterize(glyphs, ascii, 127 - 32);
+}
+
+// Must be called after the frame has been drawn
+void glyphs_collect(Glyphs *glyphs) {
+    for (size_t i = 0; i < glyphs->retired.count; i++) {
+        UnloadTexture(glyphs->retired.data[i]);
+    }
+    glyphs->retired.count = 0;
+}
+
+void glyphs_free(Glyphs *glyphs) {
+    UnloadTexture(glyphs->texture);
+    glyphs_collect(glyphs);
+    list_free(&glyphs->retired);
+
+    free(glyphs->pixels);
+    free(glyphs->table);
+    list_free(glyphs);
+}
+
+Glyph *glyphs_get(Glyphs *glyphs, int codepoint) {
+    Glyph *glyph = glyphs_find(glyphs, codepoint);
+    if (!glyph) {
+        glyphs_rasterize(glyphs, &codepoint, 1);
+        glyph = glyphs_find(glyphs, codepoint);
+        assert(glyph);
+    }
+
+    return glyph;
+}
+
+// App
+#define DOWNLOAD_LOG ".downloads.log"
+#define DOWNLOAD_FILES ".downloads.files"
+
+void scroll_clamp(float *scroll, float wheel, size_t count, size_t height) {
+    *scroll = min(max(*scroll - wheel, 0), max((float)count * ROW_SIZE - height, 0));
+}
+
+typedef struct {
+    Config config;
+    Library library;
+    Popups popups;
+
+    pid_t download_process;
+    pthread_t download_thread;
+    bool downloading;
+    bool verifying;
+    bool reload_pending;
+    size_t download_failed;
+    const char *download_link;
+
+    bool headless;
+    bool lazy;
+    VerifyMode verify;
+    volatile sig_atomic_t stopped;
+
+    struct mpd_connection *mpd;
+    double mpd_opened;
+    Pool pool;
+    Queue queue;
+    Database database;
+    Control control;
+    PlaybackSample playback;
+    Covers covers;
+    Scanner scanner;
+
+    // Playback requested while MPD was unreachable, which is replayed as soon as it is back
+    struct {
+        Artist *artist;
+        Album *album;
+        Song *song;
+    } deferred;
+
+    Glyphs glyphs;
+
+    Buffer buffer;
+    Vector2 mouse;
+} App;
+
+// Spawn a process without duplicating the address space of the GUI, which a failed exec would
+// otherwise return into. The output of the process is appended to the file if one is given
+bool app_execute(App *app, pid_t *process, char *const *args, const char *output) {
+    pid_t backup = 0;
+    if (!process) {
+        process = &backup;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    if (output) {
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, output,
+                                         O_WRONLY | O_CREAT | O_APPEND, 0644);
+        posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+    }
+
+    bool spawned = process_spawn(process, args, &actions);
+    posix_spawn_file_actions_destroy(&actions);
+
+    return spawned && process_wait(*process);
+}
+
+void app_notify(App *app, PopupType type, size_t number, const char *string) {
+    if (app->headless) {
+        popup_log(type, number, string, stdout);
+    } else {
+        popups_push(&app->popups, type, number, string);
+    }
+}
+
+void app_config_error(App *app, Error error) {
+    char message[512];
+    snprintf(message, sizeof(message), "%s: %s", error.path, error.message);
+
+    PopupType type = error.line ? POPUP_CONFIG_ERROR : POPUP_GENERAL_ERROR;
+    app_notify(app, type, error.line, message);
+}
+
+// Parse the album if it is still lazy, and have its files looked at like those of any other album
+void app_expand(App *app, Artist *artist, Album *album) {
+    if (library_expand(&app->library, artist, album)) {
+        scanner_push(&app->scanner, artist, album);
+        database_push_list(&app->database, artist, album);
+    }
+}
+
+// Check the downloaded files before anything else looks at the links
+void app_verify(App *app) {
+    Links broken = library_verify(&app->library, app->verify);
+    for (size_t i = 0; i < broken.count; i++) {
+        app_notify(app, POPUP_VERIFY_ERROR, 0, broken.data[i]->value);
+    }
+
+    if (app->headless) {
+        log_begin(stdout, "info", "verify_done");
+        printf(" broken=%zu\n", broken.count);
+    }
+    list_free(&broken);
+}
+
+bool app_downloading(App *app) {
+    return app->library.count && !app->stopped;
+}
+
+// Give the files the link was downloaded into to every other album which lists it
+bool app_download_share(LibraryLink *entry, Files *files, Buffer *buffer) {
+    bool ok = true;
+    for (size_t i = 0; ok && i < files->count; i++) {
+        char *line = files->data[i];
+        char *file = strrchr(line, '/');
+        file = file ? file + 1 : line;
+
+        for (size_t j = 1; ok && j < entry->owners.count; j++) {
+            AlbumRef owner = entry->owners.data[j];
+            mkdir(owner.artist->name, 0755);
+
+            album_ref_path(buffer, "", owner, "");
+            mkdir(buffer->data, 0755);
+
+            buffer->count--;
+            list_append(buffer, '/');
+            buffer_push_string(buffer, file);
+            list_append(buffer, '\0');
+            ok = file_share(line, buffer->data);
+            if (!ok) {
+                break;
+            }
+
+            album_ref_path(buffer, "", owner, "/.tracks");
+            FILE *tracks = fopen(buffer->data, "a");
+            if (tracks) {
+                fprintf(tracks, "%s\n", file);
+                fclose(tracks);
+            }
+        }
+    }
+
+    return ok;
+}
+
+// Record the size and hash of the files in the manifest of every album which lists the link
+bool app_download_manifest(LibraryLink *entry, Files *files, Buffer *buffer) {
+    Buffer section = {0};
+    buffer_push_string(&section, "@");
+    buffer_push_string(&section, entry->link->value);
+    list_append(&section, '\n');
+
+    for (size_t i = 0; i < files->count; i++) {
+        char *file = strrchr(files->data[i], '/');
+        file = file ? file + 1 : files->data[i];
+
+        struct stat info;
+        uint64_t hash;
+        if (stat(files->data[i], &info) < 0 || !file_hash(files->data[i], &hash)) {
+            list_free(&section);
+            return false;
+        }
+
+        char line[64];
+        snprintf(line, sizeof(line), "%lld %016llx ", (long long)info.st_size,
+                 (unsigned long long)hash);
+        buffer_push_string(&section, line);
+        buffer_push_string(&section, file);
+        list_append(&section, '\n');
+    }
+
+    bool ok = true;
+    for (size_t i = 0; i < entry->owners.count; i++) {
+        album_ref_path(buffer, "", entry->owners.data[i], MANIFEST_NAME);
+        FILE *f = fopen(buffer->data, "a");
+        if (!f) {
+            ok = false;
+            continue;
+        }
+
+        fwrite(section.data, 1, section.count, f);
+        ok = fclose(f) == 0 && ok;
+    }
+
+    list_free(&section);
+    return ok;
+}
+
+// Each distinct link is downloaded once into the first album listing it, and shared with the rest
+void *app_downloader(void *arg) {
+    App *app = arg;
+    app_notify(app, POPUP_STARTED, app->library.pending, "Download");
+
+    Buffer buffer = {0};
+    Buffer output = {0};
+    Buffer thumbnail = {0};
+    Buffer tracks = {0};
+    for (size_t i = 0; app_downloading(app) && i < app->library.links.count; i++) {
+        LibraryLink *entry = &app->library.links.data[i];
+        Link *link = entry->link;
+        if (link->ready) {
+            continue;
+        }
+
+        AlbumRef target = entry->owners.data[0];
+        album_ref_path(&output, "", target, "/%(title)s.%(ext)s");
+
+        // The thumbnail of the video serves as the cover of the album
+        album_ref_path(&thumbnail, "thumbnail:", target, "/cover.%(ext)s");
+
+        // The order of the files, for albums which leave the songs to the scanner
+        album_ref_path(&tracks, "", target, "/.tracks");
+
+        char *const args[] = {
+            "yt-dlp", "-x", "-o", output.data,
+            "--write-thumbnail", "--convert-thumbnails", "png", "-o", thumbnail.data,
+            "--print-to-file", "after_move:filepath", tracks.data,
+            "--print-to-file", "after_move:filepath", DOWNLOAD_FILES,
+            link->value, NULL,
+        };
+
+        unlink(DOWNLOAD_FILES);
+        app->download_link = link->value;
+        bool status = app_execute(app, &app->download_process, args, DOWNLOAD_LOG);
+        app->download_link = NULL;
+
+        if (app->library.count) {
+            app->download_process = 0;
+
+            Files files = files_load(DOWNLOAD_FILES);
+            status = status && app_download_share(entry, &files, &buffer) &&
+                     app_download_manifest(entry, &files, &buffer);
+            files_free(&files);
+
+            if (status) {
+                link->ready = true;
+                for (size_t j = 0; j < entry->owners.count; j++) {
+                    AlbumRef owner = entry->owners.data[j];
+                    if (!app->headless) {
+                        scanner_push(&app->scanner, owner.artist, owner.album);
+                    }
+
+                    // The album becomes playable once MPD has picked up its files
+                    if (album_links_ready(owner.album) &&
+                        !database_push(&app->database, owner.artist, owner.album)) {
+                        album_mark_ready(owner.album);
+                    }
+                }
+                app_notify(app, POPUP_DOWNLOAD_OK, 0, link->value);
+            } else {
+                app->download_failed++;
+                app_notify(app, POPUP_DOWNLOAD_ERROR, 0, link->value);
+            }
+        }
+    }
+    unlink(DOWNLOAD_FILES);
+
+    list_free(&buffer);
+    list_free(&output);
+    list_free(&thumbnail);
+    list_free(&tracks);
+    __atomic_store_n(&app->downloading, false, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Check the downloads without holding up the window, then download whatever is missing. Counts as
+// downloading, so that the config is not reloaded from under it
+void *app_verifier(void *arg) {
+    App *app = arg;
+
+    // The verification parses every lazy album, which the scanner and the database have to hear of
+    for (size_t i = 0; i < app->library.count; i++) {
+        Artist *artist = &app->library.data[i];
+        for (size_t j = 0; j < artist->count; j++) {
+            app_expand(app, artist, &artist->data[j]);
+        }
+    }
+
+    app_verify(app);
+    bool download = app->library.pending && app_downloading(app);
+    __atomic_store_n(&app->verifying, false, __ATOMIC_RELEASE);
+
+    if (download) {
+        return app_downloader(app);
+    }
+
+    __atomic_store_n(&app->downloading, false, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+bool database_quit(Database *database) {
+    pthread_mutex_lock(&database->lock);
+    bool quit = database->quit;
+    pthread_mutex_unlock(&database->lock);
+    return quit;
+}
+
+void database_sleep(Database *database, double seconds) {
+    struct pollfd fd = {.fd = database->wake[0], .events = POLLIN};
+    if (poll(&fd, 1, seconds * 1000) > 0) {
+        char drain[64];
+        while (read(database->wake[0], drain, sizeof(drain)) > 0) {
+        }
+    }
+}
+
+// Find what plays after the item, the last tracked song: the rest of its album, then the album
+// queued next by the user, then in continuous mode the albums of the same artist which follow it.
+// Lazy albums are parsed and looked up in the database on the way. An upcoming album without songs
+// ends the search, so that the one after it is tried first. Returns false if the connection broke
+bool app_queue_next(App *app, struct mpd_connection *mpd, Buffer *buffer, QueueItem *item,
+                    AlbumRef upcoming, bool continuous, bool *took) {
+    size_t next = item->album - item->artist->data + 1;
+    Songs songs = album_songs(item->album);
+    item->song = songs_next(&songs, item->song + 1);
+
+    *took = false;
+    while (item->song >= songs.count) {
+        if (upcoming.album && !*took) {
+            item->artist = upcoming.artist;
+            item->album = upcoming.album;
+            next = item->album - item->artist->data + 1;
+            *took = true;
+        } else if (continuous && next < item->artist->count && !*took) {
+            item->album = &item->artist->data[next++];
+        } else {
+            item->album = NULL;
+            return true;
+        }
+
+        if (library_expand(&app->library, item->artist, item->album)) {
+            AlbumRef ref = {
+                .artist = item->artist,
+                .album = item->album,
+            };
+
+            scanner_push(&app->scanner, item->artist, item->album);
+            if (!database_list(mpd, buffer, &ref, 1)) {
+                return false;
+            }
+        }
+
+        songs = album_songs(item->album);
+        item->song = songs.count;
+        if (item->album->ready) {
+            item->song = songs_next(&songs, 0);
+        }
+    }
+
+    return true;
+}
+
+// Append to the queue ahead of time once only a few songs are left in it, so that MPD goes on
+// without a gap. Runs on the database thread whenever the player or the queue changed. The lock is
+// only held to look at the queue and to track the appended songs, never while waiting on MPD
+bool app_queue_fill(App *app, struct mpd_connection *mpd, Buffer *buffer) {
+    Queue *queue = &app->queue;
+    Playback playback = playback_get(&app->playback);
+
+    pthread_mutex_lock(&queue->lock);
+
+    // MPD forgets the current song once it played through the whole queue
+    bool ended = playback.state == MPD_STATE_STOP && playback.song < 0;
+    size_t played = min((size_t)max(playback.song + 1, 0), queue->count);
+    bool continuous = queue->continuous;
+    bool wanted = continuous || queue->upcoming.count;
+    if (!wanted || !queue->count || (!ended && queue->count - played >= QUEUE_PREFETCH)) {
+        pthread_mutex_unlock(&queue->lock);
+        return true;
+    }
+
+    QueueItem item = queue->data[queue->count - 1];
+    size_t count = queue->count;
+    unsigned version = queue->version;
+    AlbumRef upcoming = {0};
+    if (queue->upcoming.count) {
+        upcoming = queue->upcoming.data[0];
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+
+    bool took;
+    bool ok = app_queue_next(app, mpd, buffer, &item, upcoming, continuous, &took);
+    if (!ok) {
+        return false;
+    }
+
+    Queue added = {.version = version};
+    bool appended = item.album && queue_append(mpd, buffer, &item, count, ended, &added);
+
+    // Somebody else played or cleared something while MPD was busy, which the version of the queue
+    // tells about soon enough. The songs are left untracked and the upcoming album stays
+    pthread_mutex_lock(&queue->lock);
+    bool unchanged = queue->count == count && queue->version == version;
+    if (unchanged && appended) {
+        list_append_many(queue, added.data, added.count);
+        queue->version = added.version;
+    } else if (unchanged && item.album) {
+        queue->count = 0;
+    }
+
+    bool done = unchanged && (appended || !item.album);
+    if (done && took && queue->upcoming.count && queue->upcoming.data[0].album == upcoming.album) {
+        queue->upcoming.count--;
+        memmove(queue->upcoming.data, queue->upcoming.data + 1,
+                queue->upcoming.count * sizeof(AlbumRef));
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    list_free(&added);
+
+    // Go on with the album after an upcoming one which turned out to be empty
+    if (done && took && !item.album) {
+        database_wake(&app->database);
+    }
+
+    return !item.album || appended || mpd_connection_clear_error(mpd);
+}
+
+// Serve the database and keep the pool filled up until the connection to MPD is lost
+void app_database_run(App *app, struct mpd_connection *mpd) {
+    Database *database = &app->database;
+
+    pthread_mutex_lock(&database->lock);
+    database->connected = true;
+    bool ok = !database->quit;
+    pthread_mutex_unlock(&database->lock);
+
+    // Hand out a command connection before going through the whole library
+    ok = ok && pool_fill(&app->pool) && playback_update(&app->playback, &app->queue, mpd);
+
+    Buffer buffer = {0};
+    AlbumRefs refs = {0};
+    for (size_t i = 0; ok && i < app->library.count; i++) {
+        Artist *artist = &app->library.data[i];
+        for (size_t j = 0; ok && j < artist->count; j++) {
+            AlbumRef ref = {
+                .artist = artist,
+                .album = &artist->data[j],
+            };
+
+            if (ref.album->songs.count) {
+                list_append(&refs, ref);
+            }
+
+            if (refs.count == DATABASE_BATCH) {
+                ok = database_list(mpd, &buffer, refs.data, refs.count);
+                refs.count = 0;
+            }
+        }
+    }
+
+    if (ok && refs.count) {
+        ok = database_list(mpd, &buffer, refs.data, refs.count);
+    }
+
+    AlbumRefs waiting = {0};
+    AlbumRefs listing = {0};
+    DatabaseJobs jobs = {0};
+    enum mpd_idle events = 0;
+    while (ok) {
+        pthread_mutex_lock(&database->lock);
+        bool quit = database->quit;
+        double pushed = database->pushed;
+        for (size_t i = 0; i < database->dirty.count; i++) {
+            album_refs_push(&waiting, database->dirty.data[i]);
+        }
+        database->dirty.count = 0;
+        for (size_t i = 0; i < database->listing.count; i++) {
+            album_refs_push(&listing, database->listing.data[i]);
+        }
+        database->listing.count = 0;
+        pthread_mutex_unlock(&database->lock);
+
+        if (quit) {
+            break;
+        }
+
+        char drain[64];
+        while (read(database->wake[0], drain, sizeof(drain)) > 0) {
+        }
+
+        for (size_t i = 0; ok && i < listing.count; i += DATABASE_BATCH) {
+            size_t count = min(listing.count - i, DATABASE_BATCH);
+            ok = database_list(mpd, &buffer, listing.data + i, count);
+        }
+        listing.count = 0;
+
+        // Downloads finishing in quick succession are coalesced into a single batch of updates
+        int timeout = -1;
+        if (waiting.count) {
+            double remaining = pushed + DATABASE_DEBOUNCE - time_now();
+            if (remaining <= 0) {
+                ok = database_update(mpd, &buffer, &waiting, &jobs);
+                waiting.count = 0;
+            } else {
+                timeout = remaining * 1000 + 1;
+            }
+        }
+
+        if (ok && jobs.count) {
+            ok = database_finish_jobs(mpd, &buffer, &jobs, &refs);
+        }
+
+        if (ok && (events & (MPD_IDLE_PLAYER | MPD_IDLE_QUEUE))) {
+            ok = playback_update(&app->playback, &app->queue, mpd);
+        }
+
+        if (ok) {
+            ok = app_queue_fill(app, mpd, &buffer);
+        }
+
+        // Wake up in time to replace the pooled connections before MPD closes them
+        if (ok) {
+            ok = pool_fill(&app->pool);
+        }
+
+        if (ok) {
+            int refresh = pool_timeout(&app->pool);
+            if (timeout < 0 || (refresh >= 0 && refresh < timeout)) {
+                timeout = refresh;
+            }
+            ok = database_idle(mpd, database->wake[0], timeout, &events);
+        }
+    }
+
+    // Nothing is going to report these albums anymore, so do not leave them hanging
+    pthread_mutex_lock(&database->lock);
+    database->connected = false;
+    for (size_t i = 0; i < database->dirty.count; i++) {
+        album_mark_ready(database->dirty.data[i].album);
+    }
+    database->dirty.count = 0;
+    database->listing.count = 0;
+    pthread_mutex_unlock(&database->lock);
+
+    for (size_t i = 0; i < waiting.count; i++) {
+        album_mark_ready(waiting.data[i].album);
+    }
+
+    for (size_t i = 0; i < jobs.count; i++) {
+        album_mark_ready(jobs.data[i].ref.album);
+    }
+
+    list_free(&buffer);
+    list_free(&refs);
+    list_free(&waiting);
+    list_free(&listing);
+    list_free(&jobs);
+}
+
+// Owns the connection used for idle notifications and reconnects with an exponential backoff
+void *app_database(void *arg) {
+    App *app = arg;
+    Database *database = &app->database;
+
+    double backoff = POOL_BACKOFF_MIN;
+    while (!database_quit(database)) {
+        struct mpd_connection *mpd = mpd_connection_new(NULL, 0, 0);
+        if (mpd && mpd_connection_get_error(mpd) == MPD_ERROR_SUCCESS) {
+            backoff = POOL_BACKOFF_MIN;
+            app_database_run(app, mpd);
+        }
+
+        if (mpd) {
+            mpd_connection_free(mpd);
+        }
+
+        // MPD went away, so the queue might be gone with it
+        pool_drain(&app->pool, time_now() + backoff);
+        playback_set(&app->playback, (Playback){0});
+        queue_reset(&app->queue);
+        database_sleep(database, backoff);
+        backoff = min(backoff * 2, POOL_BACKOFF_MAX);
+    }
+
+    pool_drain(&app->pool, 0);
+    return NULL;
+}
+
+void app_database_stop(App *app) {
+    Database *database = &app->database;
+    if (database->thread) {
+        pthread_mutex_lock(&database->lock);
+        database->quit = true;
+        pthread_mutex_unlock(&database->lock);
+
+        database_wake(database);
+        pthread_join(database->thread, NULL);
+        database->thread = 0;
+
+        close(database->wake[0]);
+        close(database->wake[1]);
+    }
+
+    list_free(&database->dirty);
+    list_free(&database->listing);
+}
+
+bool app_mpd_check_error(App *app) {
+    if (!app->mpd) {
+        return false;
+    }
+
+    if (mpd_connection_get_error(app->mpd) != MPD_ERROR_SUCCESS) {
+        static char buffer[256];
+        snprintf(buffer, sizeof(buffer), "%s", mpd_connection_get_error_message(app->mpd));
+
+        // A lost connection is reported by the status line rather than a popup for every command,
+        // and the background thread takes care of reconnecting
+        if (mpd_connection_clear_error(app->mpd)) {
+            popups_push(&app->popups, POPUP_GENERAL_ERROR, 0, buffer);
+        } else {
+            mpd_connection_free(app->mpd);
+            app->mpd = NULL;
+        }
+
+        return false;
+    }
+
+    return true;
+}
+
+bool app_mpd_play(App *app, Artist *artist, Album *album, size_t song) {
+    if (!app->mpd) {
+        return false;
+    }
+
+    if (!queue_play(&app->queue, app->mpd, &app->buffer, artist, album, song)) {
+        app_mpd_check_error(app);
+        return false;
+    }
+
+    return true;
+}
+
+void app_mpd_load_song(App *app, Artist *artist, Album *album, Song *song) {
+    if (!app->mpd) {
+        app->deferred.artist = artist;
+        app->deferred.album = album;
+        app->deferred.song = song;
+        return;
+    }
+
+    Songs songs = album_songs(album);
+    if (app_mpd_play(app, artist, album, songs_index(&songs, song))) {
+        popups_push(&app->popups, POPUP_STARTED, 1, "Song");
+    }
+}
+
+void app_mpd_load_album(App *app, Artist *artist, Album *album) {
+    if (!app->mpd) {
+        app->deferred.artist = artist;
+        app->deferred.album = album;
+        app->deferred.song = NULL;
+        return;
+    }
+
+    // Songs which MPD does not know about are skipped
+    Songs songs = album_songs(album);
+    size_t first = songs_next(&songs, 0);
+    size_t count = 0;
+    for (size_t i = first; i < songs.count; i = songs_next(&songs, i + 1)) {
+        count++;
+    }
+
+    if (count == 0) {
+        popups_push(&app->popups, POPUP_GENERAL_ERROR, 0, "None of the songs are known to MPD");
+    } else if (app_mpd_play(app, artist, album, first)) {
+        popups_push(&app->popups, POPUP_STARTED, count, "Song");
+    }
+}
+
+// Play the album once the queue runs out. The database thread appends it when it is time
+bool app_queue_album(App *app, Artist *artist, Album *album) {
+    if (!album->ready) {
+        return false;
+    }
+
+    AlbumRef ref = {
+        .artist = artist,
+        .album = album,
+    };
+
+    pthread_mutex_lock(&app->queue.lock);
+    album_refs_push(&app->queue.upcoming, ref);
+    pthread_mutex_unlock(&app->queue.lock);
+
+    database_wake(&app->database);
+    return true;
+}
+
+void app_queue_continuous(App *app, bool continuous) {
+    pthread_mutex_lock(&app->queue.lock);
+    app->queue.continuous = continuous;
+    pthread_mutex_unlock(&app->queue.lock);
+
+    database_wake(&app->database);
+}
+
+// Pick up a connection once the background thread has one ready. Commands issued in the meantime
+// are dropped, except for the last playback request. Nothing polls MPD on this connection, so it
+// is swapped for a fresh one before MPD closes it for being idle
+bool app_mpd_acquire(App *app) {
+    bool connected = app->mpd != NULL;
+    app->mpd = pool_renew(&app->pool, app->mpd, &app->mpd_opened);
+    if (connected || !app->mpd) {
+        return app->mpd != NULL;
+    }
+
+    if (app->deferred.album) {
+        Artist *artist = app->deferred.artist;
+        Album *album = app->deferred.album;
+        Song *song = app->deferred.song;
+        memset(&app->deferred, 0, sizeof(app->deferred));
+
+        if (song) {
+            app_mpd_load_song(app, artist, album, song);
+        } else {
+            app_mpd_load_album(app, artist, album);
+        }
+    }
+
+    return app->mpd != NULL;
+}
+
+struct mpd_connection *app_control_mpd(App *app) {
+    Control *control = &app->control;
+    control->mpd = pool_renew(&app->pool, control->mpd, &control->opened);
+    return control->mpd;
+}
+
+// Returns the error of the last command if there was one. A broken connection is given back so that
+// a fresh one is taken from the pool next time
+const char *app_control_error(App *app) {
+    Control *control = &app->control;
+    if (!control->mpd) {
+        return "MPD is unreachable";
+    }
+
+    if (mpd_connection_get_error(control->mpd) == MPD_ERROR_SUCCESS) {
+        return NULL;
+    }
+
+    snprintf(control->error, sizeof(control->error), "%s",
+             mpd_connection_get_error_message(control->mpd));
+
+    if (!mpd_connection_clear_error(control->mpd)) {
+        mpd_connection_free(control->mpd);
+        control->mpd = NULL;
+    }
+
+    return control->error;
+}
+
+// Consecutive transport commands are sent as a single command list
+void app_control_flush(App *app) {
+    Control *control = &app->control;
+    if (!control->batch) {
+        return;
+    }
+
+    mpd_command_list_end(control->mpd);
+    mpd_response_finish(control->mpd);
+
+    const char *error = app_control_error(app);
+    for (size_t i = 0; i < control->batch; i++) {
+        control_reply(control, error ? "ERR " : "OK", error);
+    }
+    control->batch = 0;
+}
+
+// Find the artist, album and song named by a path like 'Artist/Album/Song'. Trailing parts can be
+// left out, in which case they are NULL
+const char *app_control_find(App *app, Str path, Artist **artist, Album **album, Song **song) {
+    *artist = NULL;
+    *album = NULL;
+    *song = NULL;
+
+    Str name = str_split(&path, '/');
+    for (size_t i = 0; !*artist && i < app->library.count; i++) {
+        if (str_match(name, app->library.data[i].name)) {
+            *artist = &app->library.data[i];
+        }
+    }
+
+    if (!*artist) {
+        return "no such artist";
+    }
+
+    if (path.size == 0) {
+        return NULL;
+    }
+
+    name = str_split(&path, '/');
+    for (size_t i = 0; !*album && i < (*artist)->count; i++) {
+        if (str_match(name, (*artist)->data[i].name)) {
+            *album = &(*artist)->data[i];
+        }
+    }
+
+    if (!*album) {
+        return "no such album";
+    }
+    app_expand(app, *artist, *album);
+
+    if (path.size == 0) {
+        return NULL;
+    }
+
+    Songs songs = album_songs(*album);
+    for (size_t i = 0; !*song && i < songs.count; i++) {
+        if (str_match(path, songs.data[i].name)) {
+            *song = &songs.data[i];
+        }
+    }
+
+    return *song ? NULL : "no such song";
+}
+
+void app_control_play(App *app, Str path) {
+    Control *control = &app->control;
+
+    Artist *artist;
+    Album *album;
+    Song *song;
+    const char *error = app_control_find(app, path, &artist, &album, &song);
+    if (error) {
+        control_reply(control, "ERR ", error);
+        return;
+    }
+
+    // An artist on its own plays its first album which is ready
+    for (size_t i = 0; !album && i < artist->count; i++) {
+        if (artist->data[i].ready && artist->data[i].songs.count) {
+            album = &artist->data[i];
+        }
+    }
+
+    if (!album || !album->ready) {
+        control_reply(control, "ERR ", "album is not ready");
+        return;
+    }
+
+    struct mpd_connection *mpd = app_control_mpd(app);
+    Songs songs = album_songs(album);
+    size_t index = song ? songs_index(&songs, song) : songs_next(&songs, 0);
+    if (!mpd || !queue_play(&app->queue, mpd, &control->buffer, artist, album, index)) {
+        error = app_control_error(app);
+        control_reply(control, "ERR ", error ? error : "song is not available");
+        return;
+    }
+
+    control_reply(control, "OK", NULL);
+}
+
+void app_control_queue(App *app, Str path) {
+    Control *control = &app->control;
+
+    Artist *artist;
+    Album *album;
+    Song *song;
+    const char *error = app_control_find(app, path, &artist, &album, &song);
+    if (!error && (!album || song)) {
+        error = "expected an album";
+    }
+
+    if (error) {
+        control_reply(control, "ERR ", error);
+    } else if (!app_queue_album(app, artist, album)) {
+        control_reply(control, "ERR ", "album is not ready");
+    } else {
+        control_reply(control, "OK", NULL);
+    }
+}
+
+void app_control_continuous(App *app, Str argument) {
+    Control *control = &app->control;
+
+    bool on = str_match(argument, "on");
+    if (!on && !str_match(argument, "off")) {
+        control_reply(control, "ERR ", "expected on or off");
+        return;
+    }
+
+    app_queue_continuous(app, on);
+    control_reply(control, "OK", NULL);
+}
+
+void app_control_status(App *app) {
+    Control *control = &app->control;
+
+    const char *states[] = {
+        [MPD_STATE_UNKNOWN] = "unknown",
+        [MPD_STATE_STOP] = "stop",
+        [MPD_STATE_PLAY] = "play",
+        [MPD_STATE_PAUSE] = "pause",
+    };
+    Playback playback = playback_get(&app->playback);
+    control_reply(control, "state: ", states[playback.state]);
+
+    QueueItem item = {0};
+    Songs songs = {0};
+    if (playback.state > MPD_STATE_STOP && queue_get(&app->queue, playback.song, &item)) {
+        songs = album_songs(item.album);
+    }
+
+    // The songs of the album might have been replaced since it was queued
+    if (item.song < songs.count) {
+        char time[32];
+        snprintf(time, sizeof(time), "%.1f/%.1f", playback_elapsed(&playback, time_now()),
+                 playback.total);
+
+        control_reply(control, "artist: ", item.artist->name);
+        control_reply(control, "album: ", item.album->name);
+        control_reply(control, "song: ", songs.data[item.song].name);
+        control_reply(control, "time: ", time);
+    }
+
+    control_reply(control, "OK", NULL);
+}
+
+void app_control_downloads(App *app) {
+    Control *control = &app->control;
+
+    size_t pending = 0;
+    for (size_t i = 0; i < app->library.links.count; i++) {
+        pending += !app->library.links.data[i].link->ready;
+    }
+
+    char number[32];
+    snprintf(number, sizeof(number), "%zu", pending);
+    control_reply(control, "pending: ", number);
+
+    snprintf(number, sizeof(number), "%zu", app->download_failed);
+    control_reply(control, "failed: ", number);
+
+    const char *link = app->download_link;
+    if (link) {
+        control_reply(control, "downloading: ", link);
+    }
+
+    control_reply(control, "OK", NULL);
+}
+
+void app_control_execute(App *app, Str line) {
+    Control *control = &app->control;
+
+    Str command = str_split(&line, ' ');
+    Str argument = str_trim(line, ' ');
+
+    bool toggle = str_match(command, "toggle");
+    bool next = str_match(command, "next");
+    bool previous = str_match(command, "previous");
+    bool seek = str_match(command, "seek");
+
+    if (toggle || next || previous || seek) {
+        float seconds = 0;
+        if (seek) {
+            char *end;
+            seconds = strtof(str_to_cstr(argument), &end);
+            if (argument.size == 0 || *end) {
+                app_control_flush(app);
+                control_reply(control, "ERR ", "expected seconds");
+                return;
+            }
+        }
+
+        struct mpd_connection *mpd = control->mpd;
+        if (!control->batch) {
+            mpd = app_control_mpd(app);
+            if (!mpd) {
+                control_reply(control, "ERR ", "MPD is unreachable");
+                return;
+            }
+            mpd_command_list_begin(mpd, false);
+        }
+
+        if (toggle) {
+            mpd_send_toggle_pause(mpd);
+        } else if (next) {
+            mpd_send_next(mpd);
+        } else if (previous) {
+            mpd_send_previous(mpd);
+        } else {
+            bool relative = *argument.data == '+' || *argument.data == '-';
+            mpd_send_seek_current(mpd, seconds, relative);
+        }
+
+        control->batch++;
+        return;
+    }
+
+    app_control_flush(app);
+    if (str_match(command, "play")) {
+        app_control_play(app, argument);
+    } else if (str_match(command, "queue")) {
+        app_control_queue(app, argument);
+    } else if (str_match(command, "continuous")) {
+        app_control_continuous(app, argument);
+    } else if (str_match(command, "status")) {
+        app_control_status(app);
+    } else if (str_match(command, "downloads")) {
+        app_control_downloads(app);
+    } else {
+        control_reply(control, "ERR ", "unknown command");
+    }
+}
+
+// Execute every complete line received so far. Returns false once the client should be dropped
+bool app_control_read(App *app, ControlClient *client) {
+    Control *control = &app->control;
+
+    char chunk[1024];
+    ssize_t n = read(client->fd, chunk, sizeof(chunk));
+    if (n <= 0) {
+        return false;
+    }
+    list_append_many(&client->input, chunk, n);
+
+    size_t end = client->input.count;
+    while (end > 0 && client->input.data[end - 1] != '\n') {
+        end--;
+    }
+
+    if (end == 0) {
+        return client->input.count <= CONTROL_LINE_MAX;
+    }
+
+    control->output.count = 0;
+
+    Str lines = {.data = client->input.data, .size = end};
+    while (lines.size > 0) {
+        Str line = str_trim(str_trim(str_split(&lines, '\n'), '\r'), ' ');
+        if (line.size > 0) {
+            app_control_execute(app, line);
+        }
+    }
+    app_control_flush(app);
+
+    client->input.count -= end;
+    memmove(client->input.data, client->input.data + end, client->input.count);
+
+    for (size_t i = 0; i < control->output.count;) {
+        ssize_t written = write(client->fd, control->output.data + i, control->output.count - i);
+        if (written <= 0) {
+            return false;
+        }
+        i += written;
+    }
+
+    return true;
+}
+
+void *app_control(void *arg) {
+    App *app = arg;
+    Control *control = &app->control;
+
+    while (true) {
+        struct pollfd fds[2 + CONTROL_CLIENTS] = {
+            {.fd = control->wake[0], .events = POLLIN},
+            {.fd = control->server, .events = POLLIN},
+        };
+
+        for (size_t i = 0; i < control->count; i++) {
+            fds[2 + i] = (struct pollfd){.fd = control->clients[i].fd, .events = POLLIN};
+        }
+
+        if (poll(fds, 2 + control->count, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        if (fds[0].revents) {
+            break;
+        }
+
+        for (size_t i = control->count; i-- > 0;) {
+            ControlClient *client = &control->clients[i];
+            if (fds[2 + i].revents && !app_control_read(app, client)) {
+                close(client->fd);
+                list_free(&client->input);
+                *client = control->clients[--control->count];
+            }
+        }
+
+        if (fds[1].revents & POLLIN) {
+            int fd = accept(control->server, NULL, NULL);
+            if (fd >= 0) {
+                if (control->count < CONTROL_CLIENTS) {
+                    fcntl(fd, F_SETFD, FD_CLOEXEC);
+                    control->clients[control->count++] = (ControlClient){.fd = fd};
+                } else {
+                    close(fd);
+                }
+            }
+        }
+    }
+
+    for (size_t i = 0; i < control->count; i++) {
+        close(control->clients[i].fd);
+        list_free(&control->clients[i].input);
+    }
+    control->count = 0;
+
+    if (control->mpd) {
+        mpd_connection_free(control->mpd);
+        control->mpd = NULL;
+    }
+
+    list_free(&control->output);
+    list_free(&control->buffer);
+    return NULL;
+}
+
+bool app_control_start(App *app) {
+    Control *control = &app->control;
+
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", CONTROL_PATH);
+
+    control->server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (control->server < 0) {
+        return false;
+    }
+
+    // Take over the socket left behind by an instance which did not exit cleanly, but not the one
+    // of an instance which is still running
+    if (connect(control->server, (struct sockaddr *)&address, sizeof(address)) == 0) {
+        close(control->server);
+        return false;
+    }
+    unlink(CONTROL_PATH);
+
+    if (bind(control->server, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+        chmod(CONTROL_PATH, 0600) < 0 || listen(control->server, CONTROL_CLIENTS) < 0 ||
+        pipe(control->wake) < 0) {
+        close(control->server);
+        return false;
+    }
+
+    for (size_t i = 0; i < 2; i++) {
+        fcntl(control->wake[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    if (pthread_create(&control->thread, NULL, app_control, app)) {
+        close(control->wake[0]);
+        close(control->wake[1]);
+        close(control->server);
+        return false;
+    }
+
+    return true;
+}
+
+void app_control_stop(App *app) {
+    Control *control = &app->control;
+    if (control->thread) {
+        char byte = 0;
+        if (write(control->wake[1], &byte, 1) < 0) {
+            // The thread is going to be joined either way
+        }
+        pthread_join(control->thread, NULL);
+        control->thread = 0;
+
+        close(control->wake[0]);
+        close(control->wake[1]);
+        close(control->server);
+        unlink(CONTROL_PATH);
+    }
+}
+
+// Start the threads which work on the library, verifying the downloads first if asked to
+void app_start(App *app, bool verify) {
+    app->database.quit = false;
+    if (pipe(app->database.wake) < 0) {
+        app->database.wake[0] = app->database.wake[1] = -1;
+        popups_push(&app->popups, POPUP_GENERAL_ERROR, 0, "Error: could not create database pipe");
+    } else {
+        for (size_t i = 0; i < 2; i++) {
+            fcntl(app->database.wake[i], F_SETFL, O_NONBLOCK);
+            fcntl(app->database.wake[i], F_SETFD, FD_CLOEXEC);
+        }
+        app->pool.wake = app->database.wake[1];
+
+        if (pthread_create(&app->database.thread, NULL, app_database, app)) {
+            popups_push(&app->popups, POPUP_GENERAL_ERROR, 0,
+                        "Error: could not start database thread");
+        }
+    }
+
+    if (!scanner_start(&app->scanner, &app->library)) {
+        popups_push(&app->popups, POPUP_GENERAL_ERROR, 0, "Error: could not start scanner workers");
+    }
+
+    if (verify || app->library.pending) {
+        app->downloading = true;
+        app->verifying = verify;
+        void *(*run)(void *) = verify ? app_verifier : app_downloader;
+        if (pthread_create(&app->download_thread, NULL, run, app)) {
+            app->downloading = false;
+            app->verifying = false;
+            popups_push(&app->popups, POPUP_GENERAL_ERROR, 0,
+                        "Error: could not start downloader thread");
+        }
+    }
+
+    if (!covers_start(&app->covers)) {
+        popups_push(&app->popups, POPUP_GENERAL_ERROR, 0, "Error: could not start cover workers");
+    }
+
+    if (!app_control_start(app)) {
+        popups_push(&app->popups, POPUP_GENERAL_ERROR, 0, "Error: could not start control socket");
+    }
+}
+
+// Stop everything app_start started, except for the downloader, and let go of the library. The
+// downloader stops on its own once the library is empty
+void app_stop(App *app) {
+    app_control_stop(app);
+    app_database_stop(app);
+    covers_stop(&app->covers);
 
-    *process = fork();
-    if (*process == -1) {
-        return false;
+    scanner_stop(&app->scanner);
+    if (app->library.count) {
+        scanner_save(&app->scanner, &app->library, SCANNER_CACHE);
     }
+    scanner_free(&app->scanner);
 
-    if (*process == 0) {
-        execvp(*args, args);
-        return false;
-    }
+    // The queued songs point into the library
+    queue_reset(&app->queue);
+    app->queue.upcoming.count = 0;
+    memset(&app->deferred, 0, sizeof(app->deferred));
 
-    int status = 0;
-    if (waitpid(*process, &status, 0) == -1) {
-        return false;
+    if (app->library.count) {
+        library_save_links(&app->library, ".links");
     }
+    library_free(&app->library);
+}
+
+// A queued song or album by name, as the library it points into does not outlive a reload
+typedef struct {
+    char *artist;
+    char *album;
+    char *song;
+    size_t index;
+    unsigned id;
+} QueueName;
+
+typedef struct {
+    QueueName *data;
+    size_t count;
+    size_t capacity;
+} QueueNames;
+
+typedef struct {
+    QueueNames items;
+    QueueNames upcoming;
+    QueueName deferred;
+} QueueSaved;
+
+QueueName queue_name(Artist *artist, Album *album, Song *song) {
+    return (QueueName){
+        .artist = strdup(artist->name),
+        .album = strdup(album->name),
+        .song = song ? strdup(song->path) : NULL,
+    };
+}
 
-    return WEXITSTATUS(status) == 0;
+void queue_name_free(QueueName *name) {
+    free(name->artist);
+    free(name->album);
+    free(name->song);
 }
 
-void *app_downloader(void *arg) {
-    App *app = arg;
-    popups_push(&app->popups, POPUP_STARTED, app->library.pending, "Download");
+void queue_names_free(QueueNames *names) {
+    for (size_t i = 0; i < names->count; i++) {
+        queue_name_free(&names->data[i]);
+    }
+    list_free(names);
+}
 
-    Buffer buffer = {0};
+// Find the album again in the reloaded library, parsing it if it is lazy. The song is SIZE_MAX if
+// the album does not list its songs yet. Returns false if the album or the song is gone
+bool app_find_name(App *app, QueueName *name, AlbumRef *ref, size_t *song) {
     for (size_t i = 0; i < app->library.count; i++) {
         Artist *artist = &app->library.data[i];
+        if (strcmp(artist->name, name->artist)) {
+            continue;
+        }
 
-        buffer.count = 0;
-        buffer_push_string(&buffer, artist->name);
-        list_append(&buffer, '/');
-
-        size_t start = buffer.count;
-        for (size_t j = 0; app->library.count && j < artist->count; j++) {
+        for (size_t j = 0; j < artist->count; j++) {
             Album *album = &artist->data[j];
+            if (strcmp(album->name, name->album)) {
+                continue;
+            }
 
-            buffer.count = start;
-            buffer_push_string(&buffer, album->name);
-            buffer_push_string(&buffer, "/%(title)s.%(ext)s");
-            list_append(&buffer, '\0');
-
-            for (size_t k = 0; app->library.count && k < album->links.count; k++) {
-                Link *link = &album->links.data[k];
-                if (link->ready) {
-                    continue;
-                }
+            library_expand(&app->library, artist, album);
+            ref->artist = artist;
+            ref->album = album;
+            *song = SIZE_MAX;
 
-                char *const args[] = {
-                    "yt-dlp", "-x", "-o", buffer.data, link->value, NULL,
-                };
-                bool status = app_execute(app, &app->download_process, args);
-
-                if (app->library.count) {
-                    app->download_process = 0;
-                    if (status) {
-                        link->ready = true;
-                        album_mark_ready(album);
-                        popups_push(&app->popups, POPUP_DOWNLOAD_OK, 0, link->value);
-                    } else {
-                        popups_push(&app->popups, POPUP_DOWNLOAD_ERROR, 0, link->value);
-                    }
+            Songs songs = album_songs(album);
+            for (size_t k = 0; name->song && k < songs.count; k++) {
+                if (!strcmp(songs.data[k].path, name->song)) {
+                    *song = k;
+                    return true;
                 }
             }
+
+            return !name->song || songs.count == 0;
         }
     }
 
-    list_free(&buffer);
-    return NULL;
+    return false;
 }
 
-bool app_mpd_connect(App *app) {
-    if (app->mpd) {
-        mpd_connection_free(app->mpd);
+void app_queue_save(App *app, QueueSaved *saved) {
+    Queue *queue = &app->queue;
+    pthread_mutex_lock(&queue->lock);
+    for (size_t i = 0; i < queue->count; i++) {
+        QueueItem *item = &queue->data[i];
+        Songs songs = album_songs(item->album);
+        Song *song = item->song < songs.count ? &songs.data[item->song] : NULL;
+
+        QueueName name = queue_name(item->artist, item->album, song);
+        name.index = item->song;
+        name.id = item->id;
+        list_append(&saved->items, name);
     }
 
-    app->mpd = mpd_connection_new(NULL, 0, 0);
-    if (!app->mpd || mpd_connection_get_error(app->mpd) != MPD_ERROR_SUCCESS) {
-        app->mpd = NULL;
-        popups_push(&app->popups, POPUP_GENERAL_ERROR, 0, "Could not connect to MPD");
-        return false;
+    for (size_t i = 0; i < queue->upcoming.count; i++) {
+        AlbumRef ref = queue->upcoming.data[i];
+        QueueName name = queue_name(ref.artist, ref.album, NULL);
+        list_append(&saved->upcoming, name);
     }
+    pthread_mutex_unlock(&queue->lock);
 
-    return true;
-}
-
-bool app_mpd_check_error(App *app) {
-    if (!app->mpd) {
-        return app_mpd_connect(app);
+    if (app->deferred.album) {
+        saved->deferred = queue_name(app->deferred.artist, app->deferred.album, app->deferred.song);
     }
+}
 
-    if (mpd_connection_get_error(app->mpd) != MPD_ERROR_SUCCESS) {
-        static char buffer[256];
-        snprintf(buffer, sizeof(buffer), "%s", mpd_connection_get_error_message(app->mpd));
-        popups_push(&app->popups, POPUP_GENERAL_ERROR, 0, buffer);
-
-        if (!mpd_connection_clear_error(app->mpd)) {
-            app_mpd_connect(app);
+// Point the queue into the reloaded library again. The tracked songs stand for the positions in
+// the queue of MPD, so they are only kept up to the first one which is gone
+void app_queue_restore(App *app, QueueSaved *saved) {
+    Queue *queue = &app->queue;
+    AlbumRef ref;
+    size_t song;
+
+    pthread_mutex_lock(&queue->lock);
+    for (size_t i = 0; i < saved->items.count; i++) {
+        QueueName *name = &saved->items.data[i];
+        if (!app_find_name(app, name, &ref, &song)) {
+            break;
         }
 
-        return false;
-    }
+        QueueItem item = {
+            .artist = ref.artist,
+            .album = ref.album,
+            .song = song != SIZE_MAX ? song : name->index,
+            .id = name->id,
+        };
 
-    return true;
-}
+        list_append(queue, item);
+    }
 
-enum mpd_state app_mpd_get_state(App *app) {
-    if (app->mpd) {
-        struct mpd_status *status = mpd_run_status(app->mpd);
-        if (status) {
-            return mpd_status_get_state(status);
+    for (size_t i = 0; i < saved->upcoming.count; i++) {
+        if (app_find_name(app, &saved->upcoming.data[i], &ref, &song)) {
+            album_refs_push(&queue->upcoming, ref);
         }
     }
+    pthread_mutex_unlock(&queue->lock);
 
-    app_mpd_check_error(app);
-    return MPD_STATE_UNKNOWN;
-}
-
-void app_mpd_load_song(App *app, Artist *artist, Album *album, Song *song) {
-    if (!app->mpd) {
-        return;
+    if (saved->deferred.album && app_find_name(app, &saved->deferred, &ref, &song)) {
+        Songs songs = album_songs(ref.album);
+        app->deferred.artist = ref.artist;
+        app->deferred.album = ref.album;
+        app->deferred.song = song != SIZE_MAX ? &songs.data[song] : NULL;
     }
+}
 
-    app->buffer.count = 0;
-    buffer_push_string(&app->buffer, artist->name);
-    list_append(&app->buffer, '/');
-    buffer_push_string(&app->buffer, album->name);
-    list_append(&app->buffer, '/');
-    buffer_push_string(&app->buffer, song->path);
-    list_append(&app->buffer, '\0');
-
-    mpd_command_list_begin(app->mpd, true);
-    mpd_send_clear(app->mpd);
-    mpd_send_add(app->mpd, app->buffer.data);
-    mpd_send_play(app->mpd);
-    mpd_command_list_end(app->mpd);
-    mpd_response_finish(app->mpd);
-
-    if (app_mpd_check_error(app)) {
-        popups_push(&app->popups, POPUP_STARTED, 1, "Song");
-    }
+void app_queue_saved_free(QueueSaved *saved) {
+    queue_names_free(&saved->items);
+    queue_names_free(&saved->upcoming);
+    queue_name_free(&saved->deferred);
 }
 
-void app_mpd_load_album(App *app, Artist *artist, Album *album) {
-    if (!app->mpd || album->songs.count == 0) {
-        return;
+// Load the config again, parsing only the files which changed, and find the queue in it again.
+// Returns false while the downloader is still busy, as it cannot be stopped halfway through
+bool app_reload(App *app) {
+    if (__atomic_load_n(&app->downloading, __ATOMIC_ACQUIRE)) {
+        if (!app->reload_pending) {
+            app->reload_pending = true;
+            app_notify(app, POPUP_RELOAD_PENDING, 0, NULL);
+        }
+        return false;
     }
 
-    app->buffer.count = 0;
-    buffer_push_string(&app->buffer, artist->name);
-    list_append(&app->buffer, '/');
-    buffer_push_string(&app->buffer, album->name);
-    list_append(&app->buffer, '/');
-
-    mpd_command_list_begin(app->mpd, true);
-    mpd_send_clear(app->mpd);
+    app->reload_pending = false;
+    if (app->download_thread) {
+        pthread_join(app->download_thread, NULL);
+        app->download_thread = 0;
+    }
 
-    size_t start = app->buffer.count;
-    for (size_t i = 0; i < album->songs.count; i++) {
-        app->buffer.count = start;
-        buffer_push_string(&app->buffer, album->songs.data[i].path);
-        list_append(&app->buffer, '\0');
+    QueueSaved saved = {0};
+    app_queue_save(app, &saved);
+    app_stop(app);
 
-        mpd_send_add(app->mpd, app->buffer.data);
+    Error error = config_load(&app->config, &app->library, app->lazy);
+    if (error.message) {
+        library_free(&app->library);
+        app_queue_saved_free(&saved);
+        app_config_error(app, error);
+        return true;
     }
 
-    mpd_send_play(app->mpd);
-    mpd_command_list_end(app->mpd);
-    mpd_response_finish(app->mpd);
+    library_mark_links(&app->library);
+    app_queue_restore(app, &saved);
+    app_queue_saved_free(&saved);
 
-    if (app_mpd_check_error(app)) {
-        popups_push(&app->popups, POPUP_STARTED, album->songs.count, "Song");
-    }
+    app_start(app, false);
+    return true;
 }
 
 void app_init(App *app) {
@@ -680,33 +4779,40 @@ void app_init(App *app) {
     SetExitKey(KEY_Q);
     SetTargetFPS(60);
 
-    app->font = LoadFontFromMemory(".ttf", font, font_len, FONT_SIZE, 0, 0);
-    for (char ch = 32; ch < 127; ch++) {
-        GlyphInfo info = GetGlyphInfo(app->font, ch);
-        app->glyphs[ch - 32] = info.advanceX;
-    }
+    glyphs_init(&app->glyphs);
+
+    pthread_mutex_init(&app->database.lock, NULL);
+    pthread_mutex_init(&app->pool.lock, NULL);
+    pthread_mutex_init(&app->queue.lock, NULL);
+    pthread_mutex_init(&app->popups.lock, NULL);
+    pthread_mutex_init(&app->playback.lock, NULL);
+    pthread_mutex_init(&app->covers.lock, NULL);
+    pthread_cond_init(&app->covers.cond, NULL);
+    pthread_mutex_init(&app->scanner.lock, NULL);
+    pthread_cond_init(&app->scanner.cond, NULL);
 
-    app->library.config = LoadFileText(".config");
-    Error error = library_parse(&app->library);
+    Error error = config_load(&app->config, &app->library, app->lazy);
     if (error.message) {
         library_free(&app->library);
-        popups_push(&app->popups, POPUP_CONFIG_ERROR, error.line, error.message);
+        app_config_error(app, error);
         return;
     }
 
     library_mark_links(&app->library);
-    if (app->library.pending) {
-        if (pthread_create(&app->download_thread, NULL, app_downloader, app)) {
-            popups_push(&app->popups, POPUP_GENERAL_ERROR, 0,
-                        "Error: could not start downloader thread");
-        }
-    }
-
-    app_mpd_connect(app);
+    app_start(app, app->verify != VERIFY_NONE);
 }
 
 void app_exit(App *app) {
-    UnloadFont(app->font);
+    // The verification goes through the whole library, so it has to be done before that is freed.
+    // Nothing is downloaded after it once the app is stopped
+    app->stopped = true;
+    if (__atomic_load_n(&app->verifying, __ATOMIC_ACQUIRE)) {
+        pthread_join(app->download_thread, NULL);
+        app->download_thread = 0;
+    }
+
+    glyphs_free(&app->glyphs);
+    app_stop(app);
     CloseWindow();
 
     if (app->mpd) {
@@ -714,9 +4820,8 @@ void app_exit(App *app) {
     }
 
     list_free(&app->buffer);
-
-    library_save_links(&app->library, ".links");
-    library_free(&app->library);
+    list_free(&app->queue.upcoming);
+    list_free(&app->queue);
 
     if (app->download_process != 0) {
         kill(app->download_process, SIGKILL);
@@ -725,6 +4830,8 @@ void app_exit(App *app) {
     if (app->download_thread) {
         pthread_join(app->download_thread, NULL);
     }
+
+    config_free(&app->config);
 }
 
 size_t app_fit_text(App *app, const char *text, int bound, size_t *real_size) {
@@ -732,12 +4839,15 @@ size_t app_fit_text(App *app, const char *text, int bound, size_t *real_size) {
 
     int size = 0;
     while (head && *head) {
-        int final = size + app->glyphs[*head - 32];
+        int length;
+        int codepoint = GetCodepointNext(head, &length);
+
+        int final = size + glyphs_get(&app->glyphs, codepoint)->advance;
         if (final >= bound - 2 * FONT_PAD) {
             break;
         }
         size = final;
-        head++;
+        head += length;
     }
 
     if (real_size) {
@@ -747,34 +4857,77 @@ size_t app_fit_text(App *app, const char *text, int bound, size_t *real_size) {
     return head - text;
 }
 
+void app_draw_string(App *app, const char *text, size_t size, Vector2 position, Color color) {
+    const char *end = text + size;
+    while (text < end && *text) {
+        int length;
+        int codepoint = GetCodepointNext(text, &length);
+        text += length;
+
+        Glyph *glyph = glyphs_get(&app->glyphs, codepoint);
+        if (glyph->rect.width > 0) {
+            Rectangle dest = {
+                position.x + glyph->offset_x,
+                position.y + glyph->offset_y,
+                glyph->rect.width,
+                glyph->rect.height,
+            };
+            DrawTexturePro(app->glyphs.texture, glyph->rect, dest, (Vector2){0}, 0, color);
+        }
+        position.x += glyph->advance;
+    }
+}
+
 void app_draw_text(App *app, Rectangle rect, const char *text, int bound, Color color) {
     Vector2 position = {
         rect.x + FONT_PAD,
         rect.y + (rect.height - FONT_SIZE) / 2.0,
     };
     size_t end = app_fit_text(app, text, bound, NULL);
-
-    app->buffer.count = 0;
-    list_append_many(&app->buffer, text, end);
-    list_append(&app->buffer, '\0');
-
-    DrawTextEx(app->font, app->buffer.data, position, FONT_SIZE, 0, color);
+    app_draw_string(app, text, end, position, color);
 }
 
 bool app_draw_tooltip(App *app, Rectangle rect, const char *label) {
     bool hover = CheckCollisionPointRec(app->mouse, rect);
     if (hover) {
-        Vector2 size = MeasureTextEx(app->font, label, FONT_SIZE, 0);
+        size_t width;
+        size_t end = app_fit_text(app, label, GetScreenWidth(), &width);
 
         Vector2 position = {rect.x, rect.y - ROW_SIZE};
-        DrawRectangle(position.x - FONT_PAD, position.y - FONT_PAD, size.x + 2 * FONT_PAD,
-                      size.y + 2 * FONT_PAD, STATUSLINE_COLOR);
-        DrawTextEx(app->font, label, position, FONT_SIZE, 0, FOREGROUND_COLOR);
+        DrawRectangle(position.x - FONT_PAD, position.y - FONT_PAD, width + 2 * FONT_PAD,
+                      FONT_SIZE + 2 * FONT_PAD, STATUSLINE_COLOR);
+        app_draw_string(app, label, end, position, FOREGROUND_COLOR);
     }
 
     return hover;
 }
 
+// Draw the duration at the right end of the row. Returns the width left for the rest
+float app_draw_duration(App *app, Rectangle rect, float duration, Color color) {
+    if (duration <= 0) {
+        return rect.width;
+    }
+
+    char text[32];
+    int seconds = duration + 0.5;
+    if (seconds >= 3600) {
+        snprintf(text, sizeof(text), "%d:%02d:%02d", seconds / 3600, seconds / 60 % 60,
+                 seconds % 60);
+    } else {
+        snprintf(text, sizeof(text), "%d:%02d", seconds / 60, seconds % 60);
+    }
+
+    size_t width;
+    size_t end = app_fit_text(app, text, rect.width, &width);
+
+    Vector2 position = {
+        rect.x + rect.width - width - FONT_PAD,
+        rect.y + (rect.height - FONT_SIZE) / 2.0,
+    };
+    app_draw_string(app, text, end, position, color);
+    return rect.width - width - FONT_PAD;
+}
+
 bool app_draw_name_button(App *app, Rectangle rect, char *name, Vector2 mouse) {
     bool hover = CheckCollisionPointRec(mouse, rect);
     if (hover) {
@@ -785,6 +4938,35 @@ bool app_draw_name_button(App *app, Rectangle rect, char *name, Vector2 mouse) {
     return hover;
 }
 
+bool app_draw_album_button(App *app, Rectangle rect, Artist *artist, Album *album) {
+    bool hover = CheckCollisionPointRec(app->mouse, rect);
+    if (hover) {
+        DrawRectangleRec(rect, HOVER_COLOR);
+    }
+
+    Rectangle cover = {
+        rect.x + (ROW_SIZE - COVER_SIZE) / 2.0,
+        rect.y + (rect.height - COVER_SIZE) / 2.0,
+        COVER_SIZE,
+        COVER_SIZE,
+    };
+
+    Texture2D *texture = covers_get(&app->covers, artist, album);
+    if (texture) {
+        Rectangle source = {0, 0, texture->width, texture->height};
+        DrawTexturePro(*texture, source, cover, (Vector2){0}, 0, WHITE);
+    } else {
+        DrawRectangleRec(cover, BORDER_COLOR);
+    }
+
+    rect.x += ROW_SIZE;
+    rect.width -= ROW_SIZE;
+
+    float bound = app_draw_duration(app, rect, album_duration(album), DISABLED_COLOR);
+    app_draw_text(app, rect, album->name, bound, FOREGROUND_COLOR);
+    return hover;
+}
+
 bool app_draw_play_button(App *app, Rectangle rect, enum mpd_state state) {
     Color color = state > 1 ? FOREGROUND_COLOR : DISABLED_COLOR;
     if (state == MPD_STATE_PLAY) {
@@ -860,6 +5042,7 @@ bool app_draw_seek_button(App *app, Rectangle rect, enum mpd_state state, bool f
 }
 
 void app_draw_popups(App *app, int width, int height) {
+    pthread_mutex_lock(&app->popups.lock);
     float dt = GetFrameTime();
     if (app->popups.slide > 0) {
         app->popups.slide -= dt;
@@ -868,38 +5051,49 @@ void app_draw_popups(App *app, int width, int height) {
         app->popups.slide = 0;
     }
 
+    int bound = width / 3.0 - 2 * FONT_PAD;
+    Rectangle boundaries[POPUPS_CAPACITY];
+    float alphas[POPUPS_CAPACITY];
+
     for (size_t i = 0; i < app->popups.count; ++i) {
         Popup *popup = popups_get(&app->popups, i);
         popup->lifetime -= dt;
 
-        popup_render(popup, &app->buffer);
-
-        size_t size, end;
-        end = app_fit_text(app, app->buffer.data, width / 3.0 - 2 * FONT_PAD, &size);
-        app->buffer.data[end] = '\0';
+        if (popup->bound != bound) {
+            popup->end = app_fit_text(app, popup->text, bound, &popup->width);
+            popup->bound = bound;
+        }
 
-        Rectangle boundary = {
-            .x = width - size - 3 * FONT_PAD,
+        boundaries[i] = (Rectangle){
+            .x = width - popup->width - 3 * FONT_PAD,
             .y = height - (i + 1 - app->popups.slide / POPUP_SLIDEIN) * (FONT_SIZE + 3 * FONT_PAD),
-            .width = size + 2 * FONT_PAD,
+            .width = popup->width + 2 * FONT_PAD,
             .height = FONT_SIZE + 2 * FONT_PAD,
         };
 
         float t = popup->lifetime / POPUP_LIFETIME;
-        float alpha = t >= 0.5f ? 1.0f : t / 0.5f;
+        alphas[i] = t >= 0.5f ? 1.0f : t / 0.5f;
+
+        // Let raylib pick the number of segments from the radius, which is tiny here
+        Color color = ColorAlpha(popup_type_color(popup->type), alphas[i]);
+        DrawRectangleRounded(boundaries[i], 0.3, 0, color);
+    }
 
-        DrawRectangleRounded(boundary, 0.3, 20, ColorAlpha(popup_type_color(popup->type), alpha));
+    // The text comes from the glyph atlas, so drawing it after all the boxes keeps it in one batch
+    for (size_t i = 0; i < app->popups.count; ++i) {
+        Popup *popup = popups_get(&app->popups, i);
         Vector2 position = {
-            .x = boundary.x + boundary.width / 2 - size / 2.0,
-            .y = boundary.y + boundary.height / 2 - FONT_SIZE / 2.0,
+            .x = boundaries[i].x + FONT_PAD,
+            .y = boundaries[i].y + boundaries[i].height / 2 - FONT_SIZE / 2.0,
         };
-        DrawTextEx(app->font, app->buffer.data, position, FONT_SIZE, 0,
-                   ColorAlpha(BACKGROUND_COLOR, alpha));
+        app_draw_string(app, popup->text, popup->end, position,
+                        ColorAlpha(BACKGROUND_COLOR, alphas[i]));
     }
 
     while (app->popups.count > 0 && popups_last(&app->popups)->lifetime <= 0) {
         app->popups.count--;
     }
+    pthread_mutex_unlock(&app->popups.lock);
 }
 
 void app_loop(App *app) {
@@ -908,18 +5102,41 @@ void app_loop(App *app) {
 
     float scroll[3] = {0};
 
-    enum mpd_state state = MPD_STATE_UNKNOWN;
-    if (app->mpd) {
-        state = app_mpd_get_state(app);
-    }
+    long modified = config_modified(&app->config);
+    double polled = time_now();
 
-    float clock = 0.0;
     while (!WindowShouldClose()) {
+        app_mpd_acquire(app);
+
+        // The selection points into the library, which is replaced
+        if (time_now() - polled > CONFIG_POLL) {
+            polled = time_now();
+            long current = config_modified(&app->config);
+            if (current != modified && app_reload(app)) {
+                modified = current;
+                current_artist = NULL;
+                current_album = NULL;
+                memset(scroll, 0, sizeof(scroll));
+            }
+        }
+
+        Playback playback = playback_get(&app->playback);
+        enum mpd_state state = playback.state;
+
         int width = GetScreenWidth();
         int height = GetScreenHeight() - ROW_SIZE;
         float wheel = GetMouseWheelMove() * 20;
         app->mouse = GetMousePosition();
 
+        if (IsKeyReleased(KEY_C)) {
+            pthread_mutex_lock(&app->queue.lock);
+            bool continuous = !app->queue.continuous;
+            pthread_mutex_unlock(&app->queue.lock);
+
+            app_queue_continuous(app, continuous);
+            popups_push(&app->popups, POPUP_CONTINUOUS, continuous, NULL);
+        }
+
         BeginDrawing();
         {
             ClearBackground(BACKGROUND_COLOR);
@@ -965,10 +5182,19 @@ void app_loop(App *app) {
                         ROW_SIZE,
                     };
 
-                    if (app_draw_name_button(app, rect, album->name, app->mouse)) {
+                    // Do not request thumbnails for the albums out of view
+                    if (rect.y + rect.height < 0 || rect.y >= height) {
+                        continue;
+                    }
+
+                    if (app_draw_album_button(app, rect, current_artist, album)) {
                         current_album = album;
+                        app_expand(app, current_artist, current_album);
                         if (IsMouseButtonReleased(MOUSE_BUTTON_LEFT) && album->ready) {
                             app_mpd_load_album(app, current_artist, current_album);
+                        } else if (IsMouseButtonReleased(MOUSE_BUTTON_RIGHT) &&
+                                   app_queue_album(app, current_artist, current_album)) {
+                            popups_push(&app->popups, POPUP_QUEUED, 0, album->name);
                         }
                     }
                 }
@@ -976,13 +5202,14 @@ void app_loop(App *app) {
                 // Songs
                 if (current_album) {
                     if (current_album->ready) {
+                        Songs songs = album_songs(current_album);
                         if (wheel != 0.0 && app->mouse.x >= width * 2.0 / 3 &&
                             app->mouse.x < width * 3.0 / 3) {
-                            scroll_clamp(&scroll[2], wheel, current_album->songs.count, height);
+                            scroll_clamp(&scroll[2], wheel, songs.count, height);
                         }
 
-                        for (size_t i = 0; i < current_album->songs.count; i++) {
-                            Song *song = &current_album->songs.data[i];
+                        for (size_t i = 0; i < songs.count; i++) {
+                            Song *song = &songs.data[i];
                             Rectangle rect = {
                                 width * 2.0 / 3,
                                 i * ROW_SIZE - scroll[2],
@@ -990,10 +5217,24 @@ void app_loop(App *app) {
                                 ROW_SIZE,
                             };
 
-                            if (app_draw_name_button(app, rect, song->name, app->mouse)) {
-                                if (IsMouseButtonReleased(MOUSE_BUTTON_LEFT)) {
-                                    app_mpd_load_song(app, current_artist, current_album, song);
-                                }
+                            Color color = FOREGROUND_COLOR;
+                            if (song->missing || song->status == SONG_ABSENT) {
+                                color = DISABLED_COLOR;
+                            } else if (song->status == SONG_CORRUPT) {
+                                color = ERROR_COLOR;
+                            }
+
+                            bool hover = !song->missing && CheckCollisionPointRec(app->mouse, rect);
+                            if (hover) {
+                                DrawRectangleRec(rect, HOVER_COLOR);
+                            }
+
+                            float bound =
+                                app_draw_duration(app, rect, song->duration, DISABLED_COLOR);
+                            app_draw_text(app, rect, song->name, bound, color);
+
+                            if (hover && IsMouseButtonReleased(MOUSE_BUTTON_LEFT)) {
+                                app_mpd_load_song(app, current_artist, current_album, song);
                             }
                         }
                     } else {
@@ -1015,12 +5256,6 @@ void app_loop(App *app) {
             // Status
             DrawRectangle(0, height, width, ROW_SIZE, STATUSLINE_COLOR);
             if (app->mpd) {
-                clock += GetFrameTime();
-                if (clock >= 1.0) {
-                    state = app_mpd_get_state(app);
-                    clock = 0.0;
-                }
-
                 Rectangle rect = {
                     0,
                     height + FONT_PAD,
@@ -1029,57 +5264,326 @@ void app_loop(App *app) {
                 };
 
                 rect.x = (width - rect.width) / 2 + 2 * ROW_SIZE;
-                if (app_draw_seek_button(app, rect, state, true) || IsKeyReleased(KEY_F)) {
-                    mpd_run_seek_current(app->mpd, 5.0, true);
-                    app_mpd_check_error(app);
-                    state = app_mpd_get_state(app);
-                }
+                bool forward = app_draw_seek_button(app, rect, state, true) || IsKeyReleased(KEY_F);
+                float right = rect.x + rect.width;
 
                 rect.x -= ROW_SIZE;
-                if (app_draw_next_button(app, rect, state, true) || IsKeyReleased(KEY_N)) {
-                    mpd_run_next(app->mpd);
-                    app_mpd_check_error(app);
-                    state = app_mpd_get_state(app);
-                }
+                bool next = app_draw_next_button(app, rect, state, true) || IsKeyReleased(KEY_N);
 
                 rect.x -= ROW_SIZE;
-                if (app_draw_play_button(app, rect, state) || IsKeyReleased(KEY_SPACE)) {
-                    mpd_run_toggle_pause(app->mpd);
-                    app_mpd_check_error(app);
-                    state = app_mpd_get_state(app);
-                }
+                bool toggle = app_draw_play_button(app, rect, state) || IsKeyReleased(KEY_SPACE);
 
                 rect.x -= ROW_SIZE;
-                if (app_draw_next_button(app, rect, state, false) || IsKeyReleased(KEY_P)) {
-                    mpd_run_previous(app->mpd);
-                    app_mpd_check_error(app);
-                    state = app_mpd_get_state(app);
-                }
+                bool previous =
+                    app_draw_next_button(app, rect, state, false) || IsKeyReleased(KEY_P);
 
                 rect.x -= ROW_SIZE;
-                if (app_draw_seek_button(app, rect, state, false) || IsKeyReleased(KEY_B)) {
+                bool backward =
+                    app_draw_seek_button(app, rect, state, false) || IsKeyReleased(KEY_B);
+
+                // Progress
+                float elapsed = playback_elapsed(&playback, time_now());
+                if (state > MPD_STATE_STOP) {
+                    char time[32];
+                    snprintf(time, sizeof(time), "%d:%02d / %d:%02d", (int)elapsed / 60,
+                             (int)elapsed % 60, (int)playback.total / 60, (int)playback.total % 60);
+
+                    Rectangle text = {0, height, rect.x - ROW_SIZE, ROW_SIZE};
+                    app_draw_text(app, text, time, text.width, FOREGROUND_COLOR);
+                }
+
+                Rectangle bar = {
+                    right + ROW_SIZE,
+                    height,
+                    width - right - 2 * ROW_SIZE,
+                    ROW_SIZE,
+                };
+
+                float seek = -1;
+                if (bar.width > ROW_SIZE && state > MPD_STATE_STOP && playback.total > 0) {
+                    float y = bar.y + bar.height / 2;
+                    float x = bar.x + bar.width * elapsed / playback.total;
+                    Vector2 start = {bar.x, y};
+                    DrawLineEx(start, (Vector2){bar.x + bar.width, y}, 4, BORDER_COLOR);
+                    DrawLineEx(start, (Vector2){x, y}, 4, FOREGROUND_COLOR);
+
+                    if (CheckCollisionPointRec(app->mouse, bar)) {
+                        DrawCircleV((Vector2){x, y}, 6, FOREGROUND_COLOR);
+                        if (IsMouseButtonReleased(MOUSE_BUTTON_LEFT)) {
+                            seek = (app->mouse.x - bar.x) / bar.width * playback.total;
+                        }
+                    }
+                }
+
+                // MPD reports the changes through idle, which updates the playback sample
+                bool command = true;
+                if (forward) {
+                    mpd_run_seek_current(app->mpd, 5.0, true);
+                } else if (next) {
+                    mpd_run_next(app->mpd);
+                } else if (toggle) {
+                    mpd_run_toggle_pause(app->mpd);
+                } else if (previous) {
+                    mpd_run_previous(app->mpd);
+                } else if (backward) {
                     mpd_run_seek_current(app->mpd, -5.0, true);
+                } else if (seek >= 0) {
+                    mpd_run_seek_current(app->mpd, seek, false);
+                } else {
+                    command = false;
+                }
+
+                if (command) {
                     app_mpd_check_error(app);
-                    state = app_mpd_get_state(app);
                 }
+            } else {
+                char status[64];
+                double retry = pool_retry(&app->pool);
+                if (retry > 0) {
+                    snprintf(status, sizeof(status), "MPD is unreachable, retrying in %ds",
+                             (int)max(retry - time_now(), 0) + 1);
+                } else {
+                    snprintf(status, sizeof(status), "Connecting to MPD");
+                }
+
+                Rectangle rect = {0, height, width, ROW_SIZE};
+                app_draw_text(app, rect, status, width, DISABLED_COLOR);
             }
         }
         EndDrawing();
+        glyphs_collect(&app->glyphs);
+        covers_upload(&app->covers);
     }
 
     list_free(&app->buffer);
 }
 
+// Sync
+#define SYNC_INTERVAL 5
+
+App *sync_app;
+
+void sync_signal(int sig) {
+    (void)sig;
+    sync_app->stopped = true;
+    if (sync_app->download_process != 0) {
+        kill(sync_app->download_process, SIGTERM);
+    }
+}
+
+// Run the download pipeline once. Returns the exit status, zero if everything was downloaded
+int app_sync_once(App *app) {
+    memset(&app->library, 0, sizeof(app->library));
+    app->download_failed = 0;
+
+    Error error = config_load(&app->config, &app->library, app->lazy);
+    if (error.message) {
+        library_free(&app->library);
+        app_config_error(app, error);
+        return 2;
+    }
+
+    library_mark_links(&app->library);
+    if (app->verify) {
+        app_verify(app);
+    }
+
+    if (app->library.pending) {
+        app_downloader(app);
+    }
+
+    if (!library_save_links(&app->library, ".links")) {
+        app_notify(app, POPUP_GENERAL_ERROR, 0, "could not save .links");
+        app->download_failed++;
+    }
+
+    log_begin(stdout, "info", "sync_done");
+    printf(" pending=%zu failed=%zu\n", app->library.pending, app->download_failed);
+
+    library_free(&app->library);
+    return app->download_failed ? 1 : 0;
+}
+
+// Download without a window. As a daemon the pipeline runs again whenever .config changes
+int app_sync(App *app, bool daemon) {
+    app->headless = true;
+    sync_app = app;
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    SetTraceLogLevel(LOG_NONE);
+    pthread_mutex_init(&app->database.lock, NULL);
+
+    struct sigaction action = {.sa_handler = sync_signal};
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    int status = app_sync_once(app);
+    if (!daemon) {
+        return status;
+    }
+
+    long modified = config_modified(&app->config);
+    while (!app->stopped) {
+        sleep(SYNC_INTERVAL);
+
+        long current = config_modified(&app->config);
+        if (current != modified && !app->stopped) {
+            modified = current;
+
+            log_begin(stdout, "info", "config_changed");
+            fputc('\n', stdout);
+            app_sync_once(app);
+        }
+    }
+
+    return 0;
+}
+
+// Bench
+#define BENCH_LAUNCHES 500
+
+// Resident set size in kilobytes
+long bench_rss(void) {
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(f);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+bool bench_spawn(char *const *args) {
+    pid_t process;
+    return process_spawn(&process, args, NULL) && process_wait(process);
+}
+
+// How yt-dlp used to be started
+bool bench_fork(char *const *args) {
+    pid_t process = fork();
+    if (process < 0) {
+        return false;
+    }
+
+    if (process == 0) {
+        execvp(*args, args);
+        _exit(127);
+    }
+
+    return process_wait(process);
+}
+
+// Launch a program which exits right away with both methods, from a process holding the library
+// like the player does. The page faults are the ones taken by the parent
+int app_bench(App *app) {
+    app->headless = true;
+    SetTraceLogLevel(LOG_NONE);
+
+    Error error = config_load(&app->config, &app->library, false);
+    if (error.message) {
+        library_free(&app->library);
+        app_config_error(app, error);
+        return 2;
+    }
+
+    const char *names[] = {"posix_spawn", "fork"};
+    bool (*launchers[])(char *const *) = {bench_spawn, bench_fork};
+    char *const args[] = {"true", NULL};
+
+    for (size_t i = 0; i < 2; i++) {
+        struct rusage before, after;
+        long rss = bench_rss();
+        getrusage(RUSAGE_SELF, &before);
+        double start = time_now();
+
+        size_t failed = 0;
+        for (size_t j = 0; j < BENCH_LAUNCHES; j++) {
+            failed += !launchers[i](args);
+        }
+
+        double elapsed = time_now() - start;
+        getrusage(RUSAGE_SELF, &after);
+
+        log_begin(stdout, "info", "bench");
+        log_value(stdout, "method", names[i]);
+        printf(" launches=%d failed=%zu latency_us=%.1f", BENCH_LAUNCHES, failed,
+               elapsed / BENCH_LAUNCHES * 1e6);
+        printf(" minor_faults=%.1f rss_kb=%ld rss_after_kb=%ld\n",
+               (double)(after.ru_minflt - before.ru_minflt) / BENCH_LAUNCHES, rss, bench_rss());
+    }
+
+    library_free(&app->library);
+    config_free(&app->config);
+    return 0;
+}
+
 // Main
+void usage(FILE *f, const char *program) {
+    fprintf(f,
+            "Usage: %s [--sync] [--daemon] [--lazy] [--verify] [--verify-hash] [--bench-spawn] "
+            "[DIRECTORY]\n",
+            program);
+    fprintf(f, "    --sync          Download the pending links without opening a window\n");
+    fprintf(f, "    --daemon        Like --sync, but sync again whenever .config changes\n");
+    fprintf(f, "    --lazy          Parse the songs and links of an album once it is needed\n");
+    fprintf(f, "    --verify        Download the links again whose files changed size\n");
+    fprintf(f, "    --verify-hash   Like --verify, but compare the contents as well\n");
+    fprintf(f, "    --bench-spawn   Time starting processes with posix_spawn against fork\n");
+}
+
 int main(int argc, char **argv) {
-    if (argc > 1) {
-        if (chdir(argv[1]) < 0) {
-            fprintf(stderr, "Error: could not change directory to '%s'\n", argv[1]);
+    bool sync = false;
+    bool daemon = false;
+    bool lazy = false;
+    bool bench = false;
+    VerifyMode verify = VERIFY_NONE;
+    const char *directory = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--sync")) {
+            sync = true;
+        } else if (!strcmp(argv[i], "--daemon")) {
+            sync = true;
+            daemon = true;
+        } else if (!strcmp(argv[i], "--lazy")) {
+            lazy = true;
+        } else if (!strcmp(argv[i], "--verify")) {
+            verify = max(verify, VERIFY_SIZE);
+        } else if (!strcmp(argv[i], "--verify-hash")) {
+            verify = VERIFY_HASH;
+        } else if (!strcmp(argv[i], "--bench-spawn")) {
+            bench = true;
+        } else if (!strcmp(argv[i], "--help")) {
+            usage(stdout, argv[0]);
+            exit(0);
+        } else if (!directory && *argv[i] != '-') {
+            directory = argv[i];
+        } else {
+            usage(stderr, argv[0]);
+            fprintf(stderr, "Error: unexpected argument '%s'\n", argv[i]);
+            exit(1);
+        }
+    }
+
+    if (directory) {
+        if (chdir(directory) < 0) {
+            fprintf(stderr, "Error: could not change directory to '%s'\n", directory);
             exit(1);
         }
     }
 
     static App app = {0};
+    app.lazy = lazy;
+    app.verify = verify;
+    if (bench) {
+        return app_bench(&app);
+    }
+
+    if (sync) {
+        return app_sync(&app, daemon);
+    }
+
     app_init(&app);
     app_loop(&app);
     app_exit(&app);